@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <thread>
+#include <cstdio>
+#include <cctype>
+#include "animation.hpp"
+
+Animation::Animation() {
+    this->frameCount = 1;
+    this->frameRate = 24;
+}
+
+void Animation::addCameraKey(float time, const Camera& camera) {
+    CameraKey key;
+    key.time = time;
+    key.position = camera.position;
+    key.orientation = camera.orientation;
+    key.fovy = camera.fovy;
+    key.focusDist = camera.focusDist;
+    auto it = upper_bound(this->cameraKeys.begin(), this->cameraKeys.end(), time, [](float t, const CameraKey& k) { return t < k.time; });
+    this->cameraKeys.insert(it, key);
+}
+
+void Animation::addLightKey(float time, int lightIndex, const Light& light) {
+    LightKey key;
+    key.time = time;
+    key.lightIndex = lightIndex;
+    key.light = light;
+    auto it = upper_bound(this->lightKeys.begin(), this->lightKeys.end(), time, [](float t, const LightKey& k) { return t < k.time; });
+    this->lightKeys.insert(it, key);
+}
+
+static float keyWeight(float time, float timeA, float timeB) {
+    // Position of time between two keys, clamped to [0, 1]
+    if (timeB <= timeA) return 0;
+    return min(max((time - timeA) / (timeB - timeA), 0.0f), 1.0f);
+}
+
+void Animation::setFrame(Scene& scene, Camera& camera, float time) {
+    if (!this->cameraKeys.empty()) {
+        // Last key at or before time, and the next one
+        int b = upper_bound(this->cameraKeys.begin(), this->cameraKeys.end(), time, [](float t, const CameraKey& k) { return t < k.time; }) - this->cameraKeys.begin();
+        int a = max(b - 1, 0);
+        b = min(b, (int) this->cameraKeys.size() - 1);
+        CameraKey& keyA = this->cameraKeys[a];
+        CameraKey& keyB = this->cameraKeys[b];
+        float w = keyWeight(time, keyA.time, keyB.time);
+        camera.position = keyA.position * (1 - w) + keyB.position * w;
+        camera.orientation = keyA.orientation.slerp(w, keyB.orientation);
+        camera.fovy = keyA.fovy * (1 - w) + keyB.fovy * w;
+        camera.focusDist = keyA.focusDist * (1 - w) + keyB.focusDist * w;
+    }
+
+    bool lightsMoved = false;
+    for (int l = 0; l < scene.lights.size(); l++) {
+        LightKey* keyA = NULL;
+        LightKey* keyB = NULL;
+        for (auto it = this->lightKeys.begin(); it != this->lightKeys.end(); it++) {
+            if (it->lightIndex != l) continue;
+            if (it->time <= time || keyA == NULL) keyA = &*it;
+            if (it->time > time) {
+                keyB = &*it;
+                break;
+            }
+        }
+        if (keyA == NULL) continue;
+        if (keyB == NULL) keyB = keyA;
+
+        // Type and exponent of the earlier key, the rest interpolated
+        float w = keyWeight(time, keyA->time, keyB->time);
+        Light& light = scene.lights[l];
+        light = keyA->light;
+        light.color = keyA->light.color * (1 - w) + keyB->light.color * w;
+        light.position = keyA->light.position * (1 - w) + keyB->light.position * w;
+        Vector3f direction = keyA->light.direction * (1 - w) + keyB->light.direction * w;
+        if (direction.norm() > 0) {
+            light.direction = direction.normalized();
+        }
+        light.spotSize = keyA->light.spotSize * (1 - w) + keyB->light.spotSize * w;
+        light.precompute();
+        lightsMoved = true;
+    }
+    // Bounds and cones of the light tree follow the keyed lights
+    if (lightsMoved) {
+        scene.buildLightTree();
+    }
+}
+
+int Animation::frameFilename(const string& filenamePattern, int frame, string& filename) {
+    // The frame number is substituted here, the pattern is never used as a format string
+    size_t percent = filenamePattern.find('%');
+    if (percent == string::npos || filenamePattern.find('%', percent + 1) != string::npos) {
+        return -1;
+    }
+    size_t end = percent + 1;
+    int digits = 0;
+    if (end < filenamePattern.size() && filenamePattern[end] == '0') {
+        end++;
+        while (end < filenamePattern.size() && isdigit(filenamePattern[end]) && digits < 100) {
+            digits = digits * 10 + (filenamePattern[end] - '0');
+            end++;
+        }
+    }
+    if (end >= filenamePattern.size() || filenamePattern[end] != 'd') {
+        return -1;
+    }
+    char number[128];
+    snprintf(number, sizeof(number), "%0*d", digits, frame);
+    filename = filenamePattern.substr(0, percent) + number + filenamePattern.substr(end + 1);
+    return 0;
+}
+
+int Animation::render(Scene& scene, Camera& camera, const string& filenamePattern) {
+    string filename;
+    if (frameFilename(filenamePattern, 0, filename) != 0) {
+        return -1;
+    }
+
+    // Frames are not resumable, keep the checkpoint of a still render untouched
+    string checkpointFilename = camera.checkpointFilename;
+    camera.checkpointFilename = "";
+
+    thread preparer;
+    thread encoder;
+    if (this->prepareFrame) {
+        preparer = thread(this->prepareFrame, 0, 0.0f);
+    }
+    for (int frame = 0; frame < this->frameCount; frame++) {
+        float time = frame / this->frameRate;
+
+        if (preparer.joinable()) {
+            preparer.join();
+        }
+        if (this->applyFrame && this->applyFrame(scene, frame)) {
+            scene.updateBVH();
+        }
+        if (this->prepareFrame && frame + 1 < this->frameCount) {
+            preparer = thread(this->prepareFrame, frame + 1, (frame + 1) / this->frameRate);
+        }
+
+        this->setFrame(scene, camera, time);
+        camera.sampleImage(scene, "");
+
+        // Encode on another thread from a copy of the buffers
+        if (encoder.joinable()) {
+            encoder.join();
+        }
+        frameFilename(filenamePattern, frame, filename);
+        Camera frameImage;
+        frameImage.width = camera.width;
+        frameImage.height = camera.height;
+        frameImage.renderedImage = camera.renderedImage;
+        frameImage.sampleCount = camera.sampleCount;
+        frameImage.exposure = camera.exposure;
+        frameImage.toneMapping = camera.toneMapping;
+        frameImage.compressionLevel = camera.compressionLevel;
+        frameImage.hdrOutput = camera.hdrOutput;
+        frameImage.denoise = camera.denoise;
+        frameImage.aovs = camera.aovs;
+        frameImage.aovCount = camera.aovCount;
+        frameImage.luminanceMoments = camera.luminanceMoments;
+        encoder = thread([frameImage, filename]() mutable { frameImage.writeImage(filename); });
+    }
+    if (encoder.joinable()) {
+        encoder.join();
+    }
+
+    camera.checkpointFilename = checkpointFilename;
+    return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <functional>
+#include "surface.hpp"
+
+// Keyframed animation.
+// Every frame sets the camera and the lights from their keys and renders with the scene loaded once,
+// so geometry, decoded textures and BVHs are shared by all frames. Moving geometry is updated
+// through prepareFrame / applyFrame, and only the BVHs are refitted.
+//
+// Frame N + 1 is prepared while frame N renders, and frame N is written while frame N + 1 renders.
+
+class CameraKey {
+    public:
+    float time;
+    Vector3f position;
+    Quaternionf orientation;
+    float fovy;
+    float focusDist;
+};
+
+class LightKey {
+    public:
+    float time;
+    int lightIndex;
+    Light light;
+};
+
+class Animation {
+    public:
+    int frameCount;
+    float frameRate;
+
+    // Sorted by time, linear interpolation (spherical for orientations) between keys
+    vector<CameraKey> cameraKeys;
+    vector<LightKey> lightKeys;
+
+    // Runs on another thread while the previous frame renders, so it must not touch the scene :
+    // compute the geometry of frame (frame, time) into buffers of its own
+    function<void(int frame, float time)> prepareFrame;
+
+    // Runs between frames, copies the prepared geometry into the scene.
+    // Returns true if vertices moved, to refit the BVHs.
+    function<bool(Scene& scene, int frame)> applyFrame;
+
+    Animation();
+    void addCameraKey(float time, const Camera& camera);
+    void addLightKey(float time, int lightIndex, const Light& light);
+    void setFrame(Scene& scene, Camera& camera, float time);
+
+    // Frames are written to printf-style filenames, e.g. "data/frame%04d.png".
+    // The pattern must hold one %d or %0Nd and no other %.
+    int render(Scene& scene, Camera& camera, const string& filenamePattern);
+    static int frameFilename(const string& filenamePattern, int frame, string& filename);
+};
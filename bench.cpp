@@ -0,0 +1,371 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <ctime>
+#include <cstring>
+#include <functional>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "surface.hpp"
+#include "wavefront.hpp"
+#include "packet.hpp"
+#include "setup.hpp"
+
+// Benchmark suite of the renderer.
+// Every result is written as JSON, so that runs of different versions can be compared :
+// {"compiler": ..., "timestamp": ..., "results": [{"name": ..., "value": ..., "unit": ...}, ...]}
+
+// Hardware counter of this process, -1 if perf events are not available
+class PerfCounter {
+    public:
+    int fd;
+
+    PerfCounter(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = type;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        this->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~PerfCounter() {
+        if (this->fd >= 0) close(this->fd);
+    }
+    void start() {
+        if (this->fd < 0) return;
+        ioctl(this->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(this->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    long long stop() {
+        if (this->fd < 0) return -1;
+        ioctl(this->fd, PERF_EVENT_IOC_DISABLE, 0);
+        long long value;
+        if (read(this->fd, &value, sizeof(value)) != sizeof(value)) return -1;
+        return value;
+    }
+};
+
+class BenchResult {
+    public:
+    string name;
+    double value;
+    string unit;
+};
+
+class BenchSuite {
+    public:
+    vector<BenchResult> results;
+    string filter;
+
+    // Minimum time spent in each measurement
+    float minSeconds;
+
+    BenchSuite() {
+        this->minSeconds = 0.5f;
+    }
+
+    bool enabled(const string& name) {
+        return this->filter.empty() || name.find(this->filter) != string::npos;
+    }
+
+    void report(const string& name, double value, const string& unit) {
+        BenchResult result;
+        result.name = name;
+        result.value = value;
+        result.unit = unit;
+        this->results.push_back(result);
+        cerr << name << " " << value << " " << unit << endl;
+    }
+
+    // Seconds per call, averaged over as many calls as fit in minSeconds
+    double measure(function<void()> func) {
+        int iterations = 0;
+        auto start = chrono::steady_clock::now();
+        double seconds;
+        do {
+            func();
+            iterations++;
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        } while (seconds < this->minSeconds);
+        return seconds / iterations;
+    }
+
+    void writeJson(ostream& out) {
+        out << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"timestamp\": " << time(NULL) << ",\n  \"results\": [\n";
+        for (int i = 0; i < this->results.size(); i++) {
+            BenchResult& result = this->results[i];
+            out << "    {\"name\": \"" << result.name << "\", \"value\": " << result.value << ", \"unit\": \"" << result.unit << "\"}";
+            out << (i + 1 < this->results.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+    }
+};
+
+static long fileSize(const string& filename) {
+    struct stat info;
+    return stat(filename.c_str(), &info) == 0 ? info.st_size : 0;
+}
+
+static string writeGridModel(int size) {
+    // Synthetic OBJ file, a size x size grid of quads
+    string filename = "/tmp/bench_grid_" + to_string(getpid()) + ".obj";
+    ofstream outfile(filename);
+    for (int i = 0; i <= size; i++) {
+        for (int j = 0; j <= size; j++) {
+            outfile << "v " << (float) i / size << " " << (float) j / size << " " << sin(i * 0.1) * cos(j * 0.1) << "\n";
+            outfile << "vt " << (float) i / size << " " << (float) j / size << "\n";
+            outfile << "vn 0 0 1\n";
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            int a = i * (size + 1) + j + 1;
+            int b = a + size + 1;
+            outfile << "f " << a << "/" << a << "/" << a << " " << b << "/" << b << "/" << b << " "
+                    << b + 1 << "/" << b + 1 << "/" << b + 1 << " " << a + 1 << "/" << a + 1 << "/" << a + 1 << "\n";
+        }
+    }
+    return filename;
+}
+
+void benchLoading(BenchSuite& suite) {
+    if (suite.enabled("obj_parse")) {
+        // The scene model if present, a generated grid otherwise
+        string filename = "./data/main.obj";
+        bool generated = false;
+        Object object;
+        if (object.loadModel(filename) != 0) {
+            filename = writeGridModel(300);
+            generated = true;
+        }
+        double seconds = suite.measure([&]() { object.loadModel(filename); });
+        suite.report("obj_parse", fileSize(filename) / seconds / 1e6, "MB/s");
+        suite.report("obj_parse_triangles", object.faceMaterialIndex.size() / seconds, "triangles/s");
+        if (generated) {
+            unlink(filename.c_str());
+        }
+    }
+
+    if (suite.enabled("mtl_parse")) {
+        // Includes decoding the diffuse textures
+        double seconds = suite.measure([&]() {
+            vector<Material> materials;
+            Material::loadMaterial("./data/main.mtl", materials);
+        });
+        suite.report("mtl_parse", seconds * 1e3, "ms/file");
+    }
+
+    if (suite.enabled("swept_tessellation")) {
+        SweptSurface surface;
+        Material material;
+        double seconds = suite.measure([&]() {
+            surface = SweptSurface();
+            surface.loadModel("./data/knot.txt", 2, material);
+        });
+        suite.report("swept_tessellation", seconds * 1e3, "ms");
+        suite.report("swept_tessellation_triangles", surface.faceMaterialIndex.size() / seconds, "triangles/s");
+    }
+}
+
+void benchBVH(BenchSuite& suite, Scene& scene) {
+    if (suite.enabled("bvh_build")) {
+        double seconds = suite.measure([&]() { scene.buildBVH(); });
+        suite.report("bvh_build", seconds * 1e3, "ms");
+        suite.report("bvh_build_triangles", scene.faceVertices.size() / 3 / seconds, "triangles/s");
+    }
+    if (suite.enabled("bvh_refit")) {
+        // Vertices unchanged, so the tree stays as good as built
+        double seconds = suite.measure([&]() { scene.updateBVH(); });
+        suite.report("bvh_refit", seconds * 1e3, "ms");
+    }
+}
+
+static void cameraRays(Camera& camera, vector<Vector3f>& origins, vector<Vector3f>& directions) {
+    // One ray per pixel, ordered by 4x4 tiles for the packet tracer
+    int tileSize = PacketTracer::tileSize;
+    for (int ty = 0; ty < camera.height; ty += tileSize) {
+        for (int tx = 0; tx < camera.width; tx += tileSize) {
+            for (int i = ty; i < ty + tileSize; i++) {
+                for (int j = tx; j < tx + tileSize; j++) {
+                    Sampler sampler(camera.seed, i * camera.width + j, 0);
+                    Vector3f origin, direction;
+                    camera.generateRay(min(i, camera.height - 1), min(j, camera.width - 1), sampler, origin, direction);
+                    origins.push_back(origin);
+                    directions.push_back(direction);
+                }
+            }
+        }
+    }
+}
+
+void benchRays(BenchSuite& suite, Scene& scene, Camera& camera) {
+    vector<Vector3f> origins, directions;
+    cameraRays(camera, origins, directions);
+    int rays = origins.size();
+    vector<RayHit> hits(rays);
+
+    if (suite.enabled("closest_hit")) {
+        double seconds = suite.measure([&]() {
+            for (int r = 0; r < rays; r++) {
+                RayHit& hit = hits[r];
+                hit.collided = scene.rayTrace(origins[r], directions[r], hit.dist, hit.matIndex, hit.normal, hit.uv);
+            }
+        });
+        suite.report("closest_hit", rays / seconds, "rays/s");
+    }
+
+    if (suite.enabled("closest_hit_packet")) {
+        double seconds = suite.measure([&]() {
+            for (int r = 0; r < rays; r += PacketTracer::packetSize) {
+                PacketTracer::trace(scene, PacketTracer::packetSize, &origins[r], &directions[r], &hits[r]);
+            }
+        });
+        suite.report("closest_hit_packet", rays / seconds, "rays/s");
+    }
+
+    if (suite.enabled("shadow")) {
+        // Shadow rays from the primary hits to every light
+        vector<Vector3f> points;
+        for (int r = 0; r < rays; r++) {
+            RayHit& hit = hits[r];
+            if (scene.rayTrace(origins[r], directions[r], hit.dist, hit.matIndex, hit.normal, hit.uv)) {
+                points.push_back(origins[r] + directions[r] * hit.dist);
+            }
+        }
+        int occluded = 0;
+        double seconds = suite.measure([&]() {
+            for (auto it = points.begin(); it != points.end(); it++) {
+                for (auto light = scene.lights.begin(); light != scene.lights.end(); light++) {
+                    occluded += scene.lightOccluded(*light, *it);
+                }
+            }
+        });
+        suite.report("shadow", points.size() * scene.lights.size() / seconds, "rays/s");
+    }
+}
+
+void benchTexture(BenchSuite& suite) {
+    if (!suite.enabled("texture_lookup")) return;
+    UVImage image;
+    if (!image.loadImage("./data/moon.png")) return;
+
+    int lookups = 1 << 20;
+    vector<Vector2f> uvs;
+    Sampler sampler(0, 0, 0);
+    for (int i = 0; i < lookups; i++) {
+        uvs.push_back(Vector2f(sampler.next(), sampler.next()));
+    }
+    Vector3f sum(0, 0, 0);
+    double seconds = suite.measure([&]() {
+        for (auto it = uvs.begin(); it != uvs.end(); it++) {
+            sum += image.getValue(*it);
+        }
+    });
+    suite.report("texture_lookup", lookups / seconds, "lookups/s");
+}
+
+void benchRender(BenchSuite& suite, Scene& scene, Camera camera) {
+    // End to end, one pass of every backend on a reduced frame
+    camera.width = 320;
+    camera.height = 180;
+    camera.sampleRate = 1;
+    camera.checkpointFilename = "";
+    int samples = camera.width * camera.height;
+
+    const char* names[] = {"render_path", "render_packets", "render_wavefront", "render_wavefront_sorted"};
+    for (int variant = 0; variant < 4; variant++) {
+        if (!suite.enabled(names[variant])) continue;
+        camera.backend = variant >= 2 ? Camera::BACKEND_WAVEFRONT : Camera::BACKEND_PATH;
+        camera.packetTracing = variant == 1;
+        camera.sortRays = variant == 3;
+        double seconds = suite.measure([&]() { camera.sampleImage(scene, ""); });
+        suite.report(names[variant], samples / seconds, "samples/s");
+    }
+}
+
+void benchRaySorting(BenchSuite& suite, Scene& scene, Camera camera) {
+    // Same passes through the wavefront backend, with and without sorting secondary and shadow rays
+    if (!suite.enabled("ray_sorting")) return;
+    camera.width = 320;
+    camera.height = 180;
+    vector<int> pixels;
+    for (int i = 0; i < camera.width * camera.height; i++) {
+        pixels.push_back(i);
+    }
+
+    for (int sorted = 0; sorted < 2; sorted++) {
+        string name = sorted ? "ray_sorting_sorted" : "ray_sorting_unsorted";
+        camera.clearImage();
+        WavefrontRenderer wavefront;
+        wavefront.sortRays = sorted;
+
+        PerfCounter cacheMisses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        PerfCounter l1Misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        cacheMisses.start();
+        l1Misses.start();
+        auto start = chrono::steady_clock::now();
+        for (int k = 0; k < 4; k++) {
+            wavefront.render(scene, camera, pixels, k);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        long long l1 = l1Misses.stop();
+        long long llc = cacheMisses.stop();
+
+        long long rays = wavefront.closestHitRays + wavefront.shadowRays;
+        suite.report(name, rays / seconds, "rays/s");
+        suite.report(name + "_l1d_misses", l1, "misses");
+        suite.report(name + "_cache_misses", llc, "misses");
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchSuite suite;
+    string outputFilename;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare("--filter") == 0 && i + 1 < argc) {
+            // Only run benchmarks whose name contains this string
+            suite.filter = argv[++i];
+        }
+        else if (arg.compare("--output") == 0 && i + 1 < argc) {
+            outputFilename = argv[++i];
+        }
+        else if (arg.compare("--min-time") == 0 && i + 1 < argc) {
+            suite.minSeconds = atof(argv[++i]);
+        }
+        else {
+            cerr << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+
+    benchLoading(suite);
+    benchTexture(suite);
+
+    Scene scene;
+    Camera camera;
+    setupScene(scene);
+    setupCamera(camera);
+    benchBVH(suite, scene);
+    benchRays(suite, scene, camera);
+    benchRender(suite, scene, camera);
+    benchRaySorting(suite, scene, camera);
+
+    if (outputFilename.empty()) {
+        suite.writeJson(cout);
+    }
+    else {
+        ofstream outfile(outputFilename);
+        suite.writeJson(outfile);
+    }
+    return 0;
+}
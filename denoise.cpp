@@ -0,0 +1,160 @@
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include "denoise.hpp"
+
+// Demodulated color is divided by the albedo plus this, so black albedos keep their color
+static const float albedoEpsilon = 0.01f;
+
+static float luminance(const float* rgb) {
+    return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+}
+
+Denoiser::Denoiser() {
+    this->iterations = 5;
+    this->sigmaLuminance = 4.0f;
+    this->normalSquarings = 7;
+    this->sigmaAlbedo = 0.1f;
+}
+
+static void runRows(int height, const function<void(int, int)>& rows) {
+    // Rows interleaved over the threads
+    int threadCount = max(1, min((int) thread::hardware_concurrency(), height));
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.push_back(thread(rows, t, threadCount));
+    }
+    for (int t = 0; t < threadCount; t++) {
+        threads[t].join();
+    }
+}
+
+void Denoiser::filter(int width, int height, vector<float>& color, const vector<float>& albedo, const vector<float>& normal, vector<float>& variance) {
+    int pixelCount = width * height;
+    for (int p = 0; p < pixelCount; p++) {
+        float divisor[3];
+        for (int k = 0; k < 3; k++) {
+            divisor[k] = albedo[p * 3 + k] + albedoEpsilon;
+            color[p * 3 + k] /= divisor[k];
+        }
+        if (variance[p] >= 0) {
+            float scale = luminance(divisor);
+            variance[p] /= scale * scale;
+        }
+    }
+    runRows(height, [&](int rowBegin, int rowStep) {
+        this->estimateVariance(width, height, color, variance, rowBegin, rowStep);
+    });
+
+    vector<float> outColor(color.size());
+    vector<float> outVariance(variance.size());
+    for (int i = 0; i < this->iterations; i++) {
+        runRows(height, [&](int rowBegin, int rowStep) {
+            this->filterRows(width, height, 1 << i, color, albedo, normal, variance, outColor, outVariance, rowBegin, rowStep);
+        });
+        color.swap(outColor);
+        variance.swap(outVariance);
+    }
+
+    for (int p = 0; p < pixelCount * 3; p++) {
+        color[p] *= albedo[p] + albedoEpsilon;
+    }
+}
+
+void Denoiser::estimateVariance(int width, int height, const vector<float>& color, vector<float>& variance, int rowBegin, int rowStep) {
+    // Luminance variance of the 3x3 neighborhood for pixels without sample statistics
+    for (int y = rowBegin; y < height; y += rowStep) {
+        for (int x = 0; x < width; x++) {
+            int p = y * width + x;
+            if (variance[p] >= 0) continue;
+            float sum = 0, sumSquares = 0;
+            int count = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int qx = x + dx, qy = y + dy;
+                    if (qx < 0 || qy < 0 || qx >= width || qy >= height) continue;
+                    float l = luminance(&color[(qy * width + qx) * 3]);
+                    sum += l;
+                    sumSquares += l * l;
+                    count++;
+                }
+            }
+            variance[p] = max(sumSquares / count - (sum / count) * (sum / count), 0.0f);
+        }
+    }
+}
+
+void Denoiser::filterRows(int width, int height, int step, const vector<float>& color, const vector<float>& albedo, const vector<float>& normal,
+        const vector<float>& variance, vector<float>& outColor, vector<float>& outVariance, int rowBegin, int rowStep) {
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    static const float blur[3] = {1.0f / 4, 1.0f / 2, 1.0f / 4};
+    float albedoScale = 1 / (this->sigmaAlbedo * this->sigmaAlbedo);
+    int normalSquarings = this->normalSquarings;
+    for (int y = rowBegin; y < height; y += rowStep) {
+        // Taps inside the image
+        int dyBegin = max(-2, -y / step), dyEnd = min(2, (height - 1 - y) / step);
+        for (int x = 0; x < width; x++) {
+            int p = y * width + x;
+            int dxBegin = max(-2, -x / step), dxEnd = min(2, (width - 1 - x) / step);
+
+            // Noise of the pixel, from the variance blurred over 3x3 pixels
+            float blurred = 0, blurWeight = 0;
+            for (int dy = max(-1, -y); dy <= min(1, height - 1 - y); dy++) {
+                for (int dx = max(-1, -x); dx <= min(1, width - 1 - x); dx++) {
+                    float h = blur[dx + 1] * blur[dy + 1];
+                    blurred += h * variance[p + dy * width + dx];
+                    blurWeight += h;
+                }
+            }
+            float luminanceScale = 1 / (this->sigmaLuminance * sqrt(blurred / blurWeight) + 1e-6f);
+
+            const float* colorP = &color[p * 3];
+            const float* albedoP = &albedo[p * 3];
+            const float* normalP = &normal[p * 3];
+            bool hitP = normalP[0] != 0 || normalP[1] != 0 || normalP[2] != 0;
+            float luminanceP = luminance(colorP);
+
+            float sum0 = 0, sum1 = 0, sum2 = 0;
+            float sumVariance = 0, sumWeight = 0;
+            for (int dy = dyBegin; dy <= dyEnd; dy++) {
+                for (int dx = dxBegin; dx <= dxEnd; dx++) {
+                    int q = p + (dy * width + dx) * step;
+                    const float* colorQ = &color[q * 3];
+                    const float* albedoQ = &albedo[q * 3];
+                    const float* normalQ = &normal[q * 3];
+
+                    // Sky and surfaces are never mixed
+                    bool hitQ = normalQ[0] != 0 || normalQ[1] != 0 || normalQ[2] != 0;
+                    if (hitP != hitQ) continue;
+                    float weight = kernel[dx + 2] * kernel[dy + 2];
+                    if (hitP) {
+                        float cosine = normalP[0] * normalQ[0] + normalP[1] * normalQ[1] + normalP[2] * normalQ[2];
+                        cosine = max(cosine, 0.0f);
+                        for (int k = 0; k < normalSquarings; k++) {
+                            cosine *= cosine;
+                        }
+                        weight *= cosine;
+                    }
+                    float a0 = albedoP[0] - albedoQ[0], a1 = albedoP[1] - albedoQ[1], a2 = albedoP[2] - albedoQ[2];
+                    float albedoDistance = a0 * a0 + a1 * a1 + a2 * a2;
+                    float distance = albedoDistance * albedoScale + fabs(luminanceP - luminance(colorQ)) * luminanceScale;
+                    // Negligible weights are skipped rather than summed as slow denormals
+                    if (distance > 20) continue;
+                    weight *= exp(-distance);
+
+                    sum0 += weight * colorQ[0];
+                    sum1 += weight * colorQ[1];
+                    sum2 += weight * colorQ[2];
+                    sumVariance += weight * weight * variance[q];
+                    sumWeight += weight;
+                }
+            }
+            // The pixel itself always has weight
+            outColor[p * 3 + 0] = sum0 / sumWeight;
+            outColor[p * 3 + 1] = sum1 / sumWeight;
+            outColor[p * 3 + 2] = sum2 / sumWeight;
+            outVariance[p] = sumVariance / (sumWeight * sumWeight);
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <vector>
+
+using namespace std;
+
+// Edge-avoiding À-trous wavelet filter (Dammertz et al. 2010) guided by feature buffers.
+// Each iteration is a 5x5 B3-spline kernel with holes, twice as wide as the previous one.
+// Neighbors are weighted down when their first-hit normal or albedo differs, or when their
+// luminance differs by more than the noise of the pixel, from the variance of its samples (SVGF).
+//
+// The color is filtered divided by the albedo, so that texture detail does not get blurred,
+// and multiplied back afterwards.
+
+class Denoiser {
+    public:
+    int iterations;
+    // Luminance difference in standard deviations
+    float sigmaLuminance;
+    // Weight of the normals : their cosine squared this many times (7 : cosine^128)
+    int normalSquarings;
+    // Distance between albedos
+    float sigmaAlbedo;
+
+    Denoiser();
+
+    // Linear RGB of width x height pixels, filtered in place. albedo and normal per pixel, normal 0 where
+    // the sample missed. variance : of the luminance of each pixel, negative where unknown (estimated from
+    // the neighbors).
+    void filter(int width, int height, vector<float>& color, const vector<float>& albedo, const vector<float>& normal, vector<float>& variance);
+
+    void estimateVariance(int width, int height, const vector<float>& color, vector<float>& variance, int rowBegin, int rowStep);
+    void filterRows(int width, int height, int step, const vector<float>& color, const vector<float>& albedo, const vector<float>& normal,
+        const vector<float>& variance, vector<float>& outColor, vector<float>& outVariance, int rowBegin, int rowStep);
+};
@@ -0,0 +1,391 @@
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "farm.hpp"
+
+enum MessageType {
+    MESSAGE_JOB = 1,
+    MESSAGE_RESULT = 2,
+    MESSAGE_QUIT = 3
+};
+
+// Milliseconds a full send buffer may take to drain before the peer is given up
+static const int sendTimeout = 10000;
+
+static bool sendAll(int fd, const void* data, size_t size) {
+    // Also used on the non-blocking sockets of the coordinator, which wait for room to write
+    const char* ptr = (const char*) data;
+    while (size > 0) {
+        ssize_t sent = send(fd, ptr, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd writable;
+            writable.fd = fd;
+            writable.events = POLLOUT;
+            if (poll(&writable, 1, sendTimeout) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        ptr += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool recvAll(int fd, void* data, size_t size) {
+    char* ptr = (char*) data;
+    while (size > 0) {
+        ssize_t received = recv(fd, ptr, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        ptr += received;
+        size -= received;
+    }
+    return true;
+}
+
+static bool sendMessage(int fd, int type, const vector<char>& payload) {
+    int32_t header[] = {type, (int32_t) payload.size()};
+    if (!sendAll(fd, header, sizeof(header))) {
+        return false;
+    }
+    return payload.empty() || sendAll(fd, &payload[0], payload.size());
+}
+
+RenderCoordinator::RenderCoordinator() {
+    this->rowsPerJob = 16;
+    this->samplesPerJob = 64;
+    this->jobTimeout = 600.0f;
+}
+
+void RenderCoordinator::createJobs(Camera& camera) {
+    this->jobs.clear();
+    int rowBegin = max(camera.rowBegin, 0);
+    int rowEnd = camera.rowEnd < 0 ? camera.height : min(camera.rowEnd, camera.height);
+    for (int s = 0; s < camera.sampleRate; s += this->samplesPerJob) {
+        for (int i = rowBegin; i < rowEnd; i += this->rowsPerJob) {
+            RenderJob job;
+            job.rowBegin = i;
+            job.rowEnd = min(i + this->rowsPerJob, rowEnd);
+            job.firstSample = camera.firstSample + s;
+            job.sampleRate = min(this->samplesPerJob, camera.sampleRate - s);
+            job.done = false;
+            job.pending = true;
+            job.running = 0;
+            this->jobs.push_back(job);
+        }
+    }
+}
+
+class WorkerConnection {
+    public:
+    int fd;
+    int job;
+    vector<char> buffer;
+};
+
+int RenderCoordinator::run(Camera& camera, int port, const string& filename) {
+    int listenFd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        return -1;
+    }
+    int option = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    option = 0;
+    setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &option, sizeof(option));
+
+    sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(listenFd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0) {
+        cerr << "Cannot listen on port " << port << endl;
+        close(listenFd);
+        return -1;
+    }
+
+    camera.clearImage();
+    this->createJobs(camera);
+    deque<int> pendingJobs;
+    for (int i = 0; i < this->jobs.size(); i++) {
+        pendingJobs.push_back(i);
+    }
+    int remainingJobs = this->jobs.size();
+
+    vector<WorkerConnection> workers;
+    auto lastCheckpoint = chrono::steady_clock::now();
+
+    while (remainingJobs > 0) {
+        // Hand out pending jobs to idle workers
+        for (auto it = workers.begin(); it != workers.end(); it++) {
+            while (it->job < 0 && !pendingJobs.empty()) {
+                int id = pendingJobs.front();
+                pendingJobs.pop_front();
+                RenderJob& job = this->jobs[id];
+                job.pending = false;
+                if (job.done) continue;
+
+                int32_t content[] = {id, camera.width, camera.height, (int32_t) camera.seed, job.rowBegin, job.rowEnd, job.firstSample, job.sampleRate};
+                vector<char> payload((char*) content, (char*) content + sizeof(content));
+                if (!sendMessage(it->fd, MESSAGE_JOB, payload)) {
+                    job.pending = true;
+                    pendingJobs.push_front(id);
+                    break;
+                }
+                it->job = id;
+                if (job.running++ == 0) {
+                    job.startTime = chrono::steady_clock::now();
+                }
+            }
+        }
+
+        vector<pollfd> fds(workers.size() + 1);
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < workers.size(); i++) {
+            fds[i + 1].fd = workers[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        poll(&fds[0], fds.size(), 100);
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd >= 0) {
+                option = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                WorkerConnection worker;
+                worker.fd = fd;
+                worker.job = -1;
+                workers.push_back(worker);
+            }
+        }
+
+        vector<bool> lost(workers.size(), false);
+        for (int i = 0; i < workers.size() && i + 1 < fds.size(); i++) {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            WorkerConnection& worker = workers[i];
+
+            char chunk[65536];
+            ssize_t received = recv(worker.fd, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
+                if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+                lost[i] = true;
+                continue;
+            }
+            worker.buffer.insert(worker.buffer.end(), chunk, chunk + received);
+
+            // Parse complete messages
+            while (worker.buffer.size() >= 2 * sizeof(int32_t)) {
+                int32_t header[2];
+                memcpy(header, &worker.buffer[0], sizeof(header));
+                // No message is larger than the result of the whole frame
+                size_t largest = 3 * sizeof(int32_t) + (size_t) camera.width * camera.height * (sizeof(int32_t) + 3 * sizeof(double));
+                if (header[1] < 0 || (size_t) header[1] > largest) {
+                    lost[i] = true;
+                    break;
+                }
+                if (worker.buffer.size() < sizeof(header) + header[1]) break;
+                const char* payload = &worker.buffer[sizeof(header)];
+
+                if (header[0] == MESSAGE_RESULT && header[1] >= 3 * sizeof(int32_t)) {
+                    int32_t content[3];
+                    memcpy(content, payload, sizeof(content));
+                    int id = content[0];
+                    int pixelBegin = content[1] * camera.width;
+                    int pixelEnd = content[2] * camera.width;
+                    size_t expected = sizeof(content) + (pixelEnd - pixelBegin) * (sizeof(int32_t) + 3 * sizeof(double));
+                    bool valid = id >= 0 && id < this->jobs.size() && header[1] == expected
+                        && content[1] == this->jobs[id].rowBegin && content[2] == this->jobs[id].rowEnd;
+
+                    if (valid) {
+                        RenderJob& job = this->jobs[id];
+                        job.running--;
+                        // Results of a re-queued job are deterministic, keep the first one only
+                        if (!job.done) {
+                            const int32_t* count = (const int32_t*) (payload + sizeof(content));
+                            const double* color = (const double*) (count + (pixelEnd - pixelBegin));
+                            for (int p = pixelBegin; p < pixelEnd; p++) {
+                                camera.sampleCount[p] += count[p - pixelBegin];
+                                for (int c = 0; c < 3; c++) {
+                                    camera.renderedImage[p * 3 + c] += color[(p - pixelBegin) * 3 + c];
+                                }
+                            }
+                            job.done = true;
+                            remainingJobs--;
+                        }
+                    }
+                    else {
+                        lost[i] = true;
+                        break;
+                    }
+                    worker.job = -1;
+                }
+                worker.buffer.erase(worker.buffer.begin(), worker.buffer.begin() + sizeof(header) + header[1]);
+            }
+        }
+
+        // Re-queue the jobs of dead workers
+        for (int i = (int) workers.size() - 1; i >= 0; i--) {
+            if (!lost[i]) continue;
+            int id = workers[i].job;
+            if (id >= 0) {
+                RenderJob& job = this->jobs[id];
+                job.running--;
+                if (!job.done && !job.pending) {
+                    cerr << "Worker lost, job " << id << " re-queued" << endl;
+                    job.pending = true;
+                    pendingJobs.push_front(id);
+                }
+            }
+            close(workers[i].fd);
+            workers.erase(workers.begin() + i);
+        }
+
+        // Re-queue the jobs of slow workers, the first result wins
+        auto now = chrono::steady_clock::now();
+        for (int id = 0; id < this->jobs.size(); id++) {
+            RenderJob& job = this->jobs[id];
+            if (job.done || job.pending || job.running == 0) continue;
+            if (chrono::duration<float>(now - job.startTime).count() >= this->jobTimeout) {
+                job.pending = true;
+                job.startTime = now;
+                pendingJobs.push_back(id);
+            }
+        }
+
+        if (workers.empty() && !this->localWorkers.empty()) {
+            bool running = false;
+            for (auto it = this->localWorkers.begin(); it != this->localWorkers.end(); it++) {
+                if (*it > 0 && waitpid(*it, NULL, WNOHANG) == *it) {
+                    *it = -1;
+                }
+                running = running || *it > 0;
+            }
+            if (!running) {
+                cerr << "Every local worker exited, " << remainingJobs << " jobs left" << endl;
+                close(listenFd);
+                return -1;
+            }
+        }
+
+        if (!camera.checkpointFilename.empty() && chrono::duration<float>(now - lastCheckpoint).count() >= camera.checkpointInterval) {
+            camera.saveCheckpoint(camera.checkpointFilename);
+            lastCheckpoint = now;
+        }
+    }
+
+    for (auto it = workers.begin(); it != workers.end(); it++) {
+        sendMessage(it->fd, MESSAGE_QUIT, vector<char>());
+        close(it->fd);
+    }
+    close(listenFd);
+
+    if (!filename.empty()) {
+        camera.writeImage(filename);
+    }
+    return 0;
+}
+
+static int connectTo(const string& host, int port) {
+    addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* it = result; it != NULL; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, it->ai_addr, it->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+int RenderWorker::run(Scene& scene, Camera& camera, const string& host, int port) {
+    // The coordinator may not be listening yet
+    int fd = -1;
+    for (int retry = 0; retry < 100 && fd < 0; retry++) {
+        fd = connectTo(host, port);
+        if (fd < 0) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    int option = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+    camera.checkpointFilename = "";
+    int32_t header[2];
+    while (recvAll(fd, header, sizeof(header))) {
+        // Jobs are the largest message the coordinator sends
+        if (header[1] < 0 || header[1] > 8 * sizeof(int32_t)) {
+            break;
+        }
+        vector<char> payload(header[1]);
+        if (header[1] > 0 && !recvAll(fd, &payload[0], payload.size())) {
+            break;
+        }
+        if (header[0] == MESSAGE_QUIT) {
+            close(fd);
+            return 0;
+        }
+        if (header[0] != MESSAGE_JOB || payload.size() != 8 * sizeof(int32_t)) {
+            break;
+        }
+
+        int32_t content[8];
+        memcpy(content, &payload[0], sizeof(content));
+        if (content[1] != camera.width || content[2] != camera.height) {
+            // Not the same frame as the coordinator
+            break;
+        }
+        if (content[4] < 0 || content[4] >= content[5] || content[5] > camera.height) {
+            break;
+        }
+        camera.seed = content[3];
+        camera.rowBegin = content[4];
+        camera.rowEnd = content[5];
+        camera.firstSample = content[6];
+        camera.sampleRate = content[7];
+        camera.sampleImage(scene, "");
+
+        int pixelBegin = camera.rowBegin * camera.width;
+        int pixelEnd = camera.rowEnd * camera.width;
+        int32_t resultContent[] = {content[0], camera.rowBegin, camera.rowEnd};
+        vector<char> result((char*) resultContent, (char*) resultContent + sizeof(resultContent));
+        result.insert(result.end(), (char*) (camera.sampleCount.data() + pixelBegin), (char*) (camera.sampleCount.data() + pixelEnd));
+        result.insert(result.end(), (char*) (camera.renderedImage.data() + pixelBegin * 3), (char*) (camera.renderedImage.data() + pixelEnd * 3));
+        if (!sendMessage(fd, MESSAGE_RESULT, result)) {
+            break;
+        }
+    }
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/types.h>
+#include "surface.hpp"
+
+// Distributed rendering over TCP.
+// The coordinator splits the frame into jobs (row band x sample batch) and hands them out
+// to workers, which render them with the same Scene and Camera and send back the accumulated rows.
+//
+// Every message is a header {type, payload size} followed by the payload :
+// JOB    : {id, width, height, seed, rowBegin, rowEnd, firstSample, sampleRate}
+// RESULT : {id, rowBegin, rowEnd}, per-pixel sample counts, accumulated colors (double)
+// QUIT   : empty
+
+class RenderJob {
+    public:
+    int rowBegin;
+    int rowEnd;
+    int firstSample;
+    int sampleRate;
+
+    bool done;
+    bool pending;
+    // Number of workers currently rendering this job
+    int running;
+    chrono::steady_clock::time_point startTime;
+};
+
+class RenderCoordinator {
+    public:
+    int rowsPerJob;
+    int samplesPerJob;
+
+    // Seconds after which a running job is handed to another worker as well
+    float jobTimeout;
+
+    vector<RenderJob> jobs;
+
+    // Worker processes started with the coordinator, set to -1 once reaped. When all of them
+    // exited and no worker is connected, run fails instead of waiting forever.
+    vector<pid_t> localWorkers;
+
+    RenderCoordinator();
+    void createJobs(Camera& camera);
+    int run(Camera& camera, int port, const string& filename);
+};
+
+class RenderWorker {
+    public:
+    static int run(Scene& scene, Camera& camera, const string& host, int port);
+};
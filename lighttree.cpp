@@ -0,0 +1,155 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "surface.hpp"
+
+static float angleBetween(const Vector3f& a, const Vector3f& b) {
+    return acos(min(max(a.dot(b), -1.0f), 1.0f));
+}
+
+static void mergeCones(LightNode& node, const LightNode& a, const LightNode& b) {
+    // Smallest cone around both cones of light axes
+    node.emissionAngle = max(a.emissionAngle, b.emissionAngle);
+    const LightNode& wide = a.spreadAngle >= b.spreadAngle ? a : b;
+    const LightNode& narrow = a.spreadAngle >= b.spreadAngle ? b : a;
+    float angle = angleBetween(wide.axis, narrow.axis);
+    if (min(angle + narrow.spreadAngle, (float) M_PI) <= wide.spreadAngle) {
+        node.axis = wide.axis;
+        node.spreadAngle = wide.spreadAngle;
+        return;
+    }
+    float spread = (wide.spreadAngle + angle + narrow.spreadAngle) / 2;
+    if (spread >= M_PI) {
+        node.axis = wide.axis;
+        node.spreadAngle = M_PI;
+        return;
+    }
+    // Rotate the wide axis towards the narrow one
+    Vector3f rotationAxis = wide.axis.cross(narrow.axis);
+    if (rotationAxis.norm() < 1e-6f) {
+        node.axis = wide.axis;
+        node.spreadAngle = M_PI;
+        return;
+    }
+    node.axis = AngleAxisf(spread - wide.spreadAngle, rotationAxis.normalized()) * wide.axis;
+    node.spreadAngle = spread;
+}
+
+float LightNode::importance(const Vector3f& point) {
+    // Power over squared distance, zero if no light below can shine towards point.
+    // Only the zero needs to be exact, any positive estimate keeps the sampling unbiased.
+    Vector3f center = this->box.center();
+    Vector3f offset = point - center;
+    float radius = this->box.sizes().norm() / 2;
+    float dist2 = max(offset.squaredNorm(), radius * radius);
+    if (dist2 <= 0) {
+        dist2 = 1e-6f;
+    }
+
+    float cosine = 1;
+    if (this->spreadAngle < M_PI) {
+        float dist = offset.norm();
+        // Angle of the box seen from point, then the smallest angle between a light axis and the direction to point
+        float boxAngle = dist > radius ? asin(radius / dist) : M_PI;
+        float angle = dist > 0 ? angleBetween(this->axis, offset / dist) : 0;
+        float minAngle = max(angle - this->spreadAngle - boxAngle, 0.0f);
+        if (minAngle >= this->emissionAngle) {
+            return 0;
+        }
+        cosine = cos(minAngle);
+    }
+    return this->power * cosine / dist2;
+}
+
+int LightTree::buildNode(const vector<Light>& lights, vector<int>& indices, int begin, int end) {
+    int index = this->nodes.size();
+    this->nodes.emplace_back();
+
+    if (end - begin == 1) {
+        const Light& light = lights[indices[begin]];
+        LightNode& node = this->nodes[index];
+        node.box = AlignedBox3f(light.position, light.position);
+        node.power = light.color.mean();
+        node.light = indices[begin];
+        node.childL = node.childR = -1;
+        if (light.lightType == Light::LIGHT_SPOT) {
+            node.axis = light.direction;
+            node.spreadAngle = 0;
+            node.emissionAngle = light.spotSize;
+        }
+        else {
+            node.axis = Vector3f(0, 0, 1);
+            node.spreadAngle = M_PI;
+            node.emissionAngle = M_PI / 2;
+        }
+        return index;
+    }
+
+    // Median split along the largest extent of the positions, as BVH::build
+    AlignedBox3f box;
+    for (int i = begin; i < end; i++) {
+        box.extend(lights[indices[i]].position);
+    }
+    int axis;
+    box.sizes().maxCoeff(&axis);
+    int middle = (begin + end) / 2;
+    nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end, [&](int a, int b) {
+        return lights[a].position[axis] < lights[b].position[axis];
+    });
+
+    int childL = buildNode(lights, indices, begin, middle);
+    int childR = buildNode(lights, indices, middle, end);
+    LightNode& node = this->nodes[index];
+    LightNode& left = this->nodes[childL];
+    LightNode& right = this->nodes[childR];
+    node.box = left.box.merged(right.box);
+    node.power = left.power + right.power;
+    mergeCones(node, left, right);
+    node.childL = childL;
+    node.childR = childR;
+    node.light = -1;
+    return index;
+}
+
+void LightTree::build(const vector<Light>& lights) {
+    this->nodes.clear();
+    vector<int> indices;
+    for (int i = 0; i < lights.size(); i++) {
+        if (lights[i].lightType != Light::LIGHT_SUN) {
+            indices.push_back(i);
+        }
+    }
+    if (!indices.empty()) {
+        this->buildNode(lights, indices, 0, indices.size());
+    }
+}
+
+int LightTree::sample(const Vector3f& point, float r, float& pdf) {
+    // Descend with probabilities proportional to the importance of the children, reusing r
+    pdf = 1;
+    if (this->nodes.empty() || this->nodes[0].importance(point) <= 0) {
+        return -1;
+    }
+    int index = 0;
+    while (this->nodes[index].light < 0) {
+        LightNode& node = this->nodes[index];
+        float importanceL = this->nodes[node.childL].importance(point);
+        float importanceR = this->nodes[node.childR].importance(point);
+        if (importanceL + importanceR <= 0) {
+            return -1;
+        }
+        float probabilityL = importanceL / (importanceL + importanceR);
+        if (r < probabilityL) {
+            r = r / probabilityL;
+            pdf *= probabilityL;
+            index = node.childL;
+        }
+        else {
+            r = (r - probabilityL) / (1 - probabilityL);
+            pdf *= 1 - probabilityL;
+            index = node.childR;
+        }
+        r = min(r, 0.99999994f);
+    }
+    return this->nodes[index].light;
+}
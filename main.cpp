@@ -2,57 +2,436 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Geometry>
 #include "surface.hpp"
+#include "farm.hpp"
+#include "setup.hpp"
+#include "stats.hpp"
+#include "viewer.hpp"
 #define COS(x) cos(x * M_PI / 180.)
 #define SIN(x) sin(x * M_PI / 180.)
 #define TAN(x) tan(x * M_PI / 180.)
 
 int main(int argc, char** argv) {
 
-	vector<Light> lights;
-	vector<Material> materials;
-
 	Scene scene;
+	Camera camera;
+	setupCamera(camera);
 
+	bool resume = false;
+	string outputFilename = "data/result.png";
+	string partialFilename;
+	vector<string> mergeFilenames;
+	string tonemapFilename;
+	string compositeFilename;
+	RenderCoordinator coordinator;
+	int coordinatorPort = -1;
+	int spawnWorkers = 0;
+	string workerAddress;
+	int frameCount = 0;
+	bool viewer = false;
+	bool headless = false;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg.compare("--resume") == 0) {
+			// Continue from the last checkpoint instead of starting over
+			resume = true;
+		}
+		else if (arg.compare("--checkpoint") == 0 && i + 1 < argc) {
+			camera.checkpointFilename = argv[++i];
+		}
+		else if (arg.compare("--checkpoint-interval") == 0 && i + 1 < argc) {
+			camera.checkpointInterval = atof(argv[++i]);
+		}
+		else if (arg.compare("--size") == 0 && i + 2 < argc) {
+			camera.width = atoi(argv[++i]);
+			camera.height = atoi(argv[++i]);
+		}
+		else if (arg.compare("--spp") == 0 && i + 1 < argc) {
+			camera.sampleRate = atoi(argv[++i]);
+		}
+		else if (arg.compare("--backend") == 0 && i + 1 < argc) {
+			string backend = argv[++i];
+			if (backend.compare("path") == 0) {
+				camera.backend = Camera::BACKEND_PATH;
+			}
+			else if (backend.compare("wavefront") == 0) {
+				camera.backend = Camera::BACKEND_WAVEFRONT;
+			}
+			else {
+				cerr << "Unknown backend " << backend << endl;
+				return 1;
+			}
+		}
+		else if (arg.compare("--packets") == 0) {
+			camera.packetTracing = true;
+		}
+		else if (arg.compare("--sort-rays") == 0) {
+			camera.sortRays = true;
+		}
+		else if (arg.compare("--stats") == 0) {
+			// Count rays and tests, and write a report next to the image
+			RenderStats::enabled = true;
+		}
+		else if (arg.compare("--heatmaps") == 0) {
+			// Write per-pixel cost images next to the image
+			camera.heatmaps = true;
+		}
+		else if (arg.compare("--frames") == 0 && i + 1 < argc) {
+			// Render a turntable sequence instead of a still
+			frameCount = atoi(argv[++i]);
+		}
+		else if (arg.compare("--light-samples") == 0 && i + 1 < argc) {
+			// Pick this many point and spot lights per path vertex from the light tree
+			scene.lightSamples = atoi(argv[++i]);
+		}
+		else if (arg.compare("--stream") == 0 && i + 1 < argc) {
+			// Render and write bands of this many rows, for images too large to hold in memory
+			camera.streamRows = max(atoi(argv[++i]), 1);
+		}
+		else if (arg.compare("--hdr") == 0) {
+			// Also write the linear colors as <image>.pfm
+			camera.hdrOutput = true;
+		}
+		else if (arg.compare("--tonemap") == 0 && i + 1 < argc) {
+			// Encode the image again from a float map, nothing is rendered
+			tonemapFilename = argv[++i];
+		}
+		else if (arg.compare("--exposure") == 0 && i + 1 < argc) {
+			camera.exposure = atof(argv[++i]);
+		}
+		else if (arg.compare("--tonemap-operator") == 0 && i + 1 < argc) {
+			string toneMapping = argv[++i];
+			if (toneMapping.compare("clamp") == 0) {
+				camera.toneMapping = Camera::TONEMAP_CLAMP;
+			}
+			else if (toneMapping.compare("reinhard") == 0) {
+				camera.toneMapping = Camera::TONEMAP_REINHARD;
+			}
+			else if (toneMapping.compare("filmic") == 0) {
+				camera.toneMapping = Camera::TONEMAP_FILMIC;
+			}
+			else {
+				cerr << "Unknown tone mapping " << toneMapping << endl;
+				return 1;
+			}
+		}
+		else if (arg.compare("--png-level") == 0 && i + 1 < argc) {
+			camera.compressionLevel = min(max(atoi(argv[++i]), 0), 9);
+		}
+		else if (arg.compare("--preview") == 0 && i + 1 < argc) {
+			// Direct light only, one sample per pixel at 1 / SCALE of the resolution
+			camera.previewScale = max(atoi(argv[++i]), 1);
+		}
+		else if (arg.compare("--upscale") == 0) {
+			// Write the preview at the full resolution
+			camera.previewUpscale = true;
+		}
+		else if (arg.compare("--position") == 0 && i + 3 < argc) {
+			for (int k = 0; k < 3; k++) {
+				camera.position[k] = atof(argv[++i]);
+			}
+		}
+		else if (arg.compare("--orientation") == 0 && i + 4 < argc) {
+			// Quaternion w x y z
+			float w = atof(argv[++i]);
+			float x = atof(argv[++i]);
+			float y = atof(argv[++i]);
+			float z = atof(argv[++i]);
+			camera.orientation = Quaternionf(w, x, y, z).normalized();
+		}
+		else if (arg.compare("--fovy") == 0 && i + 1 < argc) {
+			camera.fovy = atof(argv[++i]);
+		}
+		else if (arg.compare("--focus-dist") == 0 && i + 1 < argc) {
+			camera.focusDist = atof(argv[++i]);
+		}
+		else if (arg.compare("--viewer") == 0) {
+			// Show the image in a window while it converges
+			viewer = true;
+		}
+		else if (arg.compare("--headless") == 0) {
+			// Viewer without a window, writes the output when converged
+			viewer = true;
+			headless = true;
+		}
+		else if (arg.compare("--region") == 0 && i + 4 < argc) {
+			// Render only the pixels of this rectangle (repeatable)
+			PixelRegion region;
+			region.x = atoi(argv[++i]);
+			region.y = atoi(argv[++i]);
+			region.width = atoi(argv[++i]);
+			region.height = atoi(argv[++i]);
+			camera.regions.push_back(region);
+		}
+		else if (arg.compare("--composite") == 0 && i + 1 < argc) {
+			// Image or accumulation file the regions are rendered into
+			compositeFilename = argv[++i];
+		}
+		else if (arg.compare("--crop") == 0) {
+			// Write the bounding box of the regions only
+			camera.cropOutput = true;
+		}
+		else if (arg.compare("--time-budget") == 0 && i + 1 < argc) {
+			// Add passes for this many seconds, up to --spp samples (no limit with --spp 0)
+			camera.timeBudget = atof(argv[++i]);
+		}
+		else if (arg.compare("--denoise") == 0) {
+			// Record first-hit albedo and normal, and filter the image guided by them
+			camera.denoise = true;
+		}
+		else if (arg.compare("--aov") == 0 && i + 1 < argc) {
+			// Also write this per-pixel buffer as <image>.NAME.pfm
+			string name = argv[++i];
+			if (camera.addAov(name, true) != 0) {
+				cerr << "Unknown AOV " << name << endl;
+				return 1;
+			}
+		}
+		else if (arg.compare("--seed") == 0 && i + 1 < argc) {
+			camera.seed = atoi(argv[++i]);
+		}
+		else if (arg.compare("--output") == 0 && i + 1 < argc) {
+			outputFilename = argv[++i];
+		}
+		else if (arg.compare("--samples") == 0 && i + 2 < argc) {
+			// Render sample indices [begin, end) only
+			int begin = atoi(argv[++i]);
+			int end = atoi(argv[++i]);
+			camera.firstSample = begin;
+			camera.sampleRate = end - begin;
+		}
+		else if (arg.compare("--rows") == 0 && i + 2 < argc) {
+			// Render rows [begin, end) only
+			camera.rowBegin = atoi(argv[++i]);
+			camera.rowEnd = atoi(argv[++i]);
+		}
+		else if (arg.compare("--partial") == 0 && i + 1 < argc) {
+			// Write the accumulation buffer instead of the final image
+			partialFilename = argv[++i];
+		}
+		else if (arg.compare("--merge") == 0 && i + 1 < argc) {
+			mergeFilenames.push_back(argv[++i]);
+		}
+		else if (arg.compare("--coordinator") == 0 && i + 1 < argc) {
+			// Hand out jobs to workers connecting to this port
+			coordinatorPort = atoi(argv[++i]);
+		}
+		else if (arg.compare("--spawn") == 0 && i + 1 < argc) {
+			// Start local workers for the coordinator
+			spawnWorkers = atoi(argv[++i]);
+		}
+		else if (arg.compare("--job-rows") == 0 && i + 1 < argc) {
+			coordinator.rowsPerJob = max(atoi(argv[++i]), 1);
+		}
+		else if (arg.compare("--job-samples") == 0 && i + 1 < argc) {
+			coordinator.samplesPerJob = max(atoi(argv[++i]), 1);
+		}
+		else if (arg.compare("--job-timeout") == 0 && i + 1 < argc) {
+			coordinator.jobTimeout = atof(argv[++i]);
+		}
+		else if (arg.compare("--worker") == 0 && i + 1 < argc) {
+			// Render jobs from the coordinator at host:port
+			workerAddress = argv[++i];
+		}
+		else {
+			cerr << "Unknown option " << arg << endl;
+			return 1;
+		}
+	}
 
-	Light light;
-	light.setSunLight(Vector3f(1.0, 0.896, 0.623) * 4, Vector3f(-7.26, -0.48, -4.60));
-	scene.loadLight(light);
-	light.setSpotLight(Vector3f(1.0, 0.03, 0.03) * 50, Vector3f(2.00, -5.15, 6.77), Vector3f(-0.30, 0.51, -0.74), 0.5, 1);
-	scene.loadLight(light);
-	light.setSunLight(Vector3f(0.296, 0.750, 1.0) * 10, Vector3f(2.26, 0.10, -0.70));
-	scene.loadLight(light);
-	scene.setBackgroundLight(Vector3f(0.4, 0.4, 0.4));
+	if (frameCount > 0) {
+		// Animation::render writes every frame whole, without the reports of a still
+		bool otherMode = !tonemapFilename.empty() || !mergeFilenames.empty() || !workerAddress.empty() || coordinatorPort >= 0
+			|| viewer || camera.streamRows > 0 || camera.previewScale > 0 || !partialFilename.empty() || resume;
+		bool partOfFrame = !camera.regions.empty() || camera.cropOutput || !compositeFilename.empty() || camera.rowBegin != 0 || camera.rowEnd >= 0;
+		if (otherMode || partOfFrame) {
+			cerr << "--frames renders whole frames, without --region, --crop, --composite, --rows, --stream, --preview, --partial, --resume, "
+				<< "--merge, --tonemap, --coordinator, --worker or --viewer" << endl;
+			return 1;
+		}
+		if (RenderStats::enabled || camera.heatmaps || camera.timeBudget > 0) {
+			cerr << "--frames renders every frame to --spp, without --stats, --heatmaps or --time-budget" << endl;
+			return 1;
+		}
+	}
 
-	Material::loadMaterial("./data/others.mtl", materials);
-	scene.loadSphere(Vector3f(-4.96, 0.36, 1.18), 1.18, materials[0]);
-	scene.loadSphere(Vector3f(-1.77, 3.14, 1.80), 1.80, materials[0]);
-	scene.loadSphere(Vector3f(2.36, 2.85, 0.95), 0.95, materials[0]);
-	scene.loadSphere(Vector3f(2.70, -0.13, 0.49), 0.49, materials[1], Quaternionf(AngleAxisf(M_PI * 1.7, Vector3f::UnitZ())));
+	if ((camera.cropOutput || !compositeFilename.empty()) && (camera.hdrOutput || !camera.aovs.empty())) {
+		// Crop and the PNG base image apply to the PNG only
+		cerr << "--hdr and --aov write the whole frame, without --crop or --composite" << endl;
+		return 1;
+	}
 
-	Camera camera;
-    camera.width = 320 * 6;
-    camera.height = 180 * 6;
-	camera.sampleRate = 32 * 8;
-	camera.orientation = {0.749, 0.508, 0.238, 0.352};
-	camera.position = {7.1806, -6.3057, 4.1167};
-	camera.fovy = 24.0f;
-	camera.fNumber = 2.0;
-	camera.planeDist = 0.5;
-	camera.focusDist = 8.5;
-
-	Object myObject;
-	myObject.loadModel("./data/main.obj");
-	scene.loadObject(myObject);
-
-	SweptSurface mySweptSurface;
-	mySweptSurface.loadModel("./data/knot.txt", 2, materials[2]);
-	scene.loadObject(mySweptSurface);
-	
-	scene.buildBVH();
-	camera.sampleImage(scene, "data/result.png");
+	if (camera.denoise && (!camera.regions.empty() || !compositeFilename.empty())) {
+		// Pixels outside the regions have no samples nor features to guide the filter
+		cerr << "--denoise filters the whole frame, without --region or --composite" << endl;
+		return 1;
+	}
+
+	if (!camera.aovs.empty() && (!tonemapFilename.empty() || !mergeFilenames.empty() || coordinatorPort >= 0)) {
+		// The buffers are filled while rendering, these only combine colors
+		cerr << "--aov needs a render in this process, without --tonemap, --merge or --coordinator" << endl;
+		return 1;
+	}
+
+	if (!tonemapFilename.empty()) {
+		if (camera.loadHdr(tonemapFilename) != 0) {
+			cerr << "Cannot read " << tonemapFilename << endl;
+			return 1;
+		}
+		camera.hdrOutput = false;
+		camera.writeImage(outputFilename);
+		return 0;
+	}
+
+	if (!mergeFilenames.empty()) {
+		// Combine partial accumulation files into the final image
+		for (int i = 0; i < mergeFilenames.size(); i++) {
+			if (camera.mergeCheckpoint(mergeFilenames[i]) != 0) {
+				cerr << "Cannot merge " << mergeFilenames[i] << endl;
+				return 1;
+			}
+		}
+		camera.writeImage(outputFilename);
+		return 0;
+	}
+
+	if (!workerAddress.empty()) {
+		size_t colon = workerAddress.find_last_of(':');
+		if (colon == string::npos) {
+			cerr << "Worker address must be host:port" << endl;
+			return 1;
+		}
+		setupScene(scene);
+		return RenderWorker::run(scene, camera, workerAddress.substr(0, colon), atoi(workerAddress.substr(colon + 1).c_str())) == 0 ? 0 : 1;
+	}
+
+	if (coordinatorPort >= 0) {
+		if (resume) {
+			cerr << "--coordinator renders the whole frame, without --resume" << endl;
+			return 1;
+		}
+		// Not resumable, keep the checkpoint of a still render untouched
+		camera.checkpointFilename = "";
+		for (int i = 0; i < spawnWorkers; i++) {
+			pid_t pid = fork();
+			if (pid == 0) {
+				setupScene(scene);
+				_exit(RenderWorker::run(scene, camera, "localhost", coordinatorPort) == 0 ? 0 : 1);
+			}
+			if (pid > 0) {
+				coordinator.localWorkers.push_back(pid);
+			}
+		}
+		int result = coordinator.run(camera, coordinatorPort, outputFilename);
+		// Workers the coordinator has not reaped
+		vector<pid_t>& children = coordinator.localWorkers;
+		for (int i = 0; i < children.size(); i++) {
+			if (children[i] < 0) continue;
+			if (result != 0) {
+				kill(children[i], SIGTERM);
+			}
+			waitpid(children[i], NULL, 0);
+		}
+		return result == 0 ? 0 : 1;
+	}
+
+	if (frameCount > 0) {
+		// Numbered frames, data/frame0000.png... unless the output is a pattern
+		string pattern = outputFilename.find('%') != string::npos ? outputFilename : "data/frame%04d.png";
+		string filename;
+		if (Animation::frameFilename(pattern, 0, filename) != 0) {
+			cerr << "Output pattern needs one %d or %0Nd and no other %" << endl;
+			return 1;
+		}
+		Animation animation;
+		animation.frameCount = frameCount;
+		setupAnimation(animation, camera);
+		setupScene(scene);
+		if (camera.checkAovs(scene) != 0) {
+			return 1;
+		}
+		return animation.render(scene, camera, pattern) == 0 ? 0 : 1;
+	}
+
+	if (viewer) {
+		if (!headless && getenv("DISPLAY") == NULL) {
+			cerr << "No display, use --headless" << endl;
+			return 1;
+		}
+		setupScene(scene);
+		if (camera.checkAovs(scene) != 0) {
+			return 1;
+		}
+		Viewer progressive;
+		progressive.start(scene, camera);
+		if (headless) {
+			return progressive.runHeadless(outputFilename) == 0 ? 0 : 1;
+		}
+		return progressive.runWindow(argc, argv) == 0 ? 0 : 1;
+	}
+
+	if ((camera.denoise || !camera.aovs.empty()) && (camera.previewScale > 0 || camera.streamRows > 0)) {
+		cerr << "--denoise and --aov need the whole frame, without --preview or --stream" << endl;
+		return 1;
+	}
+
+	if (camera.previewScale > 0) {
+		setupScene(scene);
+		camera.previewImage(scene, outputFilename);
+		return 0;
+	}
+
+	if (camera.streamRows > 0) {
+		bool partOfFrame = camera.rowBegin != 0 || camera.rowEnd >= 0 || camera.firstSample != 0 || !camera.regions.empty() || camera.cropOutput
+			|| !compositeFilename.empty();
+		if (resume || !partialFilename.empty() || camera.heatmaps || partOfFrame || camera.timeBudget > 0) {
+			cerr << "--stream renders the whole frame to --spp, without --resume, --partial, --heatmaps, --rows, --samples, --region, --crop, "
+				<< "--composite or --time-budget" << endl;
+			return 1;
+		}
+		setupScene(scene);
+		if (camera.streamImage(scene, outputFilename) != 0) {
+			cerr << "Cannot write " << outputFilename << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (!partialFilename.empty()) {
+		camera.checkpointFilename = partialFilename;
+		outputFilename = "";
+	}
+
+	setupScene(scene);
+	if (camera.checkAovs(scene) != 0) {
+		return 1;
+	}
+	if (!compositeFilename.empty()) {
+		if (camera.regions.empty() || camera.loadComposite(compositeFilename) != 0) {
+			cerr << "Cannot render regions into " << compositeFilename << endl;
+			return 1;
+		}
+		camera.continueImage(scene, outputFilename);
+	}
+	else if (resume) {
+		// Never start over, the next checkpoint would overwrite the one asked for
+		if (camera.loadCheckpoint(camera.checkpointFilename) != 0) {
+			cerr << "Cannot resume from " << camera.checkpointFilename << endl;
+			return 1;
+		}
+		camera.continueImage(scene, outputFilename);
+	}
+	else {
+		camera.sampleImage(scene, outputFilename);
+	}
+	if (!partialFilename.empty() && camera.saveCheckpoint(partialFilename) != 0) {
+		cerr << "Cannot write " << partialFilename << endl;
+		return 1;
+	}
 	
 	return 0;
 }
@@ -0,0 +1,191 @@
+#include <vector>
+#include <limits>
+#include <emmintrin.h>
+#include "packet.hpp"
+#include "stats.hpp"
+
+void PacketTracer::load(int count, const Vector3f* origins, const Vector3f* directions) {
+    // Unused lanes repeat the first ray and are masked out
+    for (int i = 0; i < 3; i++) {
+        for (int g = 0; g < packetSize / 4; g++) {
+            float o[4], d[4];
+            for (int l = 0; l < 4; l++) {
+                int ray = g * 4 + l < count ? g * 4 + l : 0;
+                o[l] = origins[ray][i];
+                d[l] = directions[ray][i];
+            }
+            this->origin[i][g] = _mm_loadu_ps(o);
+            this->direction[i][g] = _mm_loadu_ps(d);
+        }
+    }
+}
+
+static inline __m128 selectPs(__m128 condition, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(condition, a), _mm_andnot_ps(condition, b));
+}
+
+uint32_t PacketTracer::checkIntersection(const AlignedBox3f& box, uint32_t mask) {
+    // Same slab test as BVH::checkIntersection, with the same divisions and comparisons
+    uint32_t result = 0;
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 epsilon = _mm_set1_ps(__FLT_EPSILON__);
+    __m128 zero = _mm_setzero_ps();
+    for (int g = 0; g < packetSize / 4; g++) {
+        if (((mask >> (g * 4)) & 0xF) == 0) continue;
+
+        __m128 tMin = _mm_set1_ps(numeric_limits<float>::min());
+        __m128 tMax = _mm_set1_ps(numeric_limits<float>::max());
+        __m128 rejected = zero;
+        for (int i = 0; i < 3; i++) {
+            __m128 d = this->direction[i][g];
+            __m128 o = this->origin[i][g];
+            __m128 pMin = _mm_set1_ps(box.min()[i]);
+            __m128 pMax = _mm_set1_ps(box.max()[i]);
+
+            __m128 parallel = _mm_cmplt_ps(_mm_andnot_ps(signMask, d), epsilon);
+            __m128 outside = _mm_or_ps(_mm_cmpgt_ps(pMin, o), _mm_cmplt_ps(pMax, o));
+            rejected = _mm_or_ps(rejected, _mm_and_ps(parallel, outside));
+
+            __m128 tLow = _mm_div_ps(_mm_sub_ps(pMin, o), d);
+            __m128 tHigh = _mm_div_ps(_mm_sub_ps(pMax, o), d);
+            __m128 positive = _mm_cmpgt_ps(d, zero);
+            __m128 tNear = selectPs(positive, tLow, tHigh);
+            __m128 tFar = selectPs(positive, tHigh, tLow);
+            // max(tMin, tNear) and min(tMax, tFar) as std::max and std::min
+            tMin = selectPs(_mm_cmplt_ps(tMin, tNear), tNear, tMin);
+            tMax = selectPs(_mm_cmplt_ps(tFar, tMax), tFar, tMax);
+        }
+        __m128 hit = _mm_andnot_ps(rejected, _mm_cmple_ps(tMin, tMax));
+        result |= (uint32_t) _mm_movemask_ps(hit) << (g * 4);
+    }
+    return result & mask;
+}
+
+void PacketTracer::testLeaf(BVH* node, uint32_t mask, float* nextParam, int* faceIndex, float* minU, float* minV) {
+    // Same triangle test as BVH::intersectTriangle, four rays at a time
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 epsilon = _mm_set1_ps(__FLT_EPSILON__);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 minParam = _mm_set1_ps(1e-5f);
+    for (int g = 0; g < packetSize / 4; g++) {
+        int laneMask = (mask >> (g * 4)) & 0xF;
+        if (laneMask == 0) continue;
+
+        __m128 active = _mm_castsi128_ps(_mm_set_epi32(-(laneMask >> 3 & 1), -(laneMask >> 2 & 1), -(laneMask >> 1 & 1), -(laneMask & 1)));
+        __m128 bestParam = _mm_loadu_ps(nextParam + g * 4);
+        __m128 bestU = _mm_loadu_ps(minU + g * 4);
+        __m128 bestV = _mm_loadu_ps(minV + g * 4);
+        __m128i bestFace = _mm_loadu_si128((__m128i*) (faceIndex + g * 4));
+        __m128 o0 = this->origin[0][g], o1 = this->origin[1][g], o2 = this->origin[2][g];
+        __m128 d0 = this->direction[0][g], d1 = this->direction[1][g], d2 = this->direction[2][g];
+
+        for (int k = 0; k < node->indices.size(); k++) {
+            // Precomputed edges of the triangle
+            const TriangleBlock& block = node->blocks[k / 4];
+            int l = k % 4;
+            __m128 v1[3], v2[3], target[3];
+            for (int i = 0; i < 3; i++) {
+                v1[i] = _mm_set1_ps(block.edge1[i][l]);
+                v2[i] = _mm_set1_ps(block.edge2[i][l]);
+            }
+            target[0] = _mm_sub_ps(o0, _mm_set1_ps(block.base[0][l]));
+            target[1] = _mm_sub_ps(o1, _mm_set1_ps(block.base[1][l]));
+            target[2] = _mm_sub_ps(o2, _mm_set1_ps(block.base[2][l]));
+
+            __m128 directionV2[3];
+            directionV2[0] = _mm_sub_ps(_mm_mul_ps(d1, v2[2]), _mm_mul_ps(d2, v2[1]));
+            directionV2[1] = _mm_sub_ps(_mm_mul_ps(d2, v2[0]), _mm_mul_ps(d0, v2[2]));
+            directionV2[2] = _mm_sub_ps(_mm_mul_ps(d0, v2[1]), _mm_mul_ps(d1, v2[0]));
+            __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v1[0], directionV2[0]), _mm_mul_ps(v1[1], directionV2[1])), _mm_mul_ps(v1[2], directionV2[2]));
+            __m128 valid = _mm_andnot_ps(_mm_cmplt_ps(_mm_andnot_ps(signMask, det), epsilon), active);
+
+            __m128 invDet = _mm_div_ps(one, det);
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(target[0], directionV2[0]), _mm_mul_ps(target[1], directionV2[1])), _mm_mul_ps(target[2], directionV2[2])), invDet);
+            valid = _mm_andnot_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)), valid);
+
+            __m128 targetV1[3];
+            targetV1[0] = _mm_sub_ps(_mm_mul_ps(target[1], v1[2]), _mm_mul_ps(target[2], v1[1]));
+            targetV1[1] = _mm_sub_ps(_mm_mul_ps(target[2], v1[0]), _mm_mul_ps(target[0], v1[2]));
+            targetV1[2] = _mm_sub_ps(_mm_mul_ps(target[0], v1[1]), _mm_mul_ps(target[1], v1[0]));
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, targetV1[0]), _mm_mul_ps(d1, targetV1[1])), _mm_mul_ps(d2, targetV1[2])), invDet);
+            valid = _mm_andnot_ps(_mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)), valid);
+
+            __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(v2[0], targetV1[0]), _mm_mul_ps(v2[1], targetV1[1])), _mm_mul_ps(v2[2], targetV1[2])), invDet);
+            // t > 1e-5 in double equals t > 1e-5f for any float t
+            __m128 closer = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(t, bestParam), _mm_cmpgt_ps(t, minParam)));
+            if (_mm_movemask_ps(closer) == 0) continue;
+
+            bestParam = selectPs(closer, t, bestParam);
+            bestU = selectPs(closer, u, bestU);
+            bestV = selectPs(closer, v, bestV);
+            __m128i face = _mm_set1_epi32(block.face[l]);
+            __m128i closerInt = _mm_castps_si128(closer);
+            bestFace = _mm_or_si128(_mm_and_si128(closerInt, face), _mm_andnot_si128(closerInt, bestFace));
+        }
+
+        _mm_storeu_ps(nextParam + g * 4, bestParam);
+        _mm_storeu_ps(minU + g * 4, bestU);
+        _mm_storeu_ps(minV + g * 4, bestV);
+        _mm_storeu_si128((__m128i*) (faceIndex + g * 4), bestFace);
+    }
+}
+
+void PacketTracer::trace(Scene& scene, int count, const Vector3f* origins, const Vector3f* directions, RayHit* hits) {
+    PacketTracer packet;
+    packet.load(count, origins, directions);
+
+    float nextParam[packetSize];
+    int faceIndex[packetSize];
+    float minU[packetSize], minV[packetSize];
+    for (int r = 0; r < packetSize; r++) {
+        minU[r] = minV[r] = 0;
+        nextParam[r] = numeric_limits<float>::max();
+        faceIndex[r] = -1;
+    }
+
+    BVH* bvhStack[maxDepth];
+    uint32_t maskStack[maxDepth];
+    int stackSize = 0;
+    bvhStack[stackSize] = &scene.bvh;
+    maskStack[stackSize++] = (1u << count) - 1;
+    while (stackSize > 0) {
+        stackSize--;
+        BVH* node = bvhStack[stackSize];
+        uint32_t mask = packet.checkIntersection(node->box, maskStack[stackSize]);
+        STATS_ADD(boxTests, __builtin_popcount(maskStack[stackSize]));
+        if (mask == 0) continue;
+
+        STATS_ADD(nodesVisited, __builtin_popcount(mask));
+        if (node->isLeaf) {
+            STATS_ADD(triangleTests, __builtin_popcount(mask) * node->indices.size());
+            packet.testLeaf(node, mask, nextParam, faceIndex, minU, minV);
+        }
+        else if (__builtin_popcount(mask) < minActiveRays) {
+            // Packet diverged, continue each ray alone below this node, right child first as in BVH::trace
+            for (int r = 0; r < count; r++) {
+                if (mask >> r & 1) {
+                    node->childR->trace(origins[r], directions[r], nextParam[r], faceIndex[r], minU[r], minV[r]);
+                    node->childL->trace(origins[r], directions[r], nextParam[r], faceIndex[r], minU[r], minV[r]);
+                }
+            }
+        }
+        else {
+            bvhStack[stackSize] = node->childL;
+            maskStack[stackSize++] = mask;
+            bvhStack[stackSize] = node->childR;
+            maskStack[stackSize++] = mask;
+        }
+    }
+
+    for (int r = 0; r < count; r++) {
+        // Instances are traced one ray at a time, after the scene triangles as in Scene::rayTrace
+        int instanceIndex = -1;
+        if (!scene.instances.empty()) {
+            scene.traceInstances(origins[r], directions[r], nextParam[r], instanceIndex, faceIndex[r], minU[r], minV[r]);
+        }
+        RayHit& hit = hits[r];
+        hit.dist = nextParam[r];
+        hit.collided = scene.completeHit(origins[r], directions[r], instanceIndex, faceIndex[r], minU[r], minV[r], hit.dist, hit.matIndex, hit.normal, hit.uv);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <xmmintrin.h>
+#include "surface.hpp"
+
+// Packet tracing of coherent rays.
+// Up to 16 rays (a 4x4 pixel tile) traverse the BVH together with one stack, testing each box
+// and triangle against four rays at a time with SSE. Rays leaving the packet, when too few of them still hit a node,
+// continue the subtree alone. Every ray tests the same triangles in the same order as
+// Scene::rayTrace, so the hits are identical.
+
+class PacketTracer {
+    public:
+    static const int tileSize = 4;
+    static const int packetSize = tileSize * tileSize;
+
+    // Below this number of active rays, the rays of a node are traced one by one
+    static const int minActiveRays = 2;
+
+    // Traversal stack size
+    static const int maxDepth = BVH::maxDepth;
+
+    // Ray components, four rays per register
+    __m128 origin[3][packetSize / 4];
+    __m128 direction[3][packetSize / 4];
+
+    void load(int count, const Vector3f* origins, const Vector3f* directions);
+    uint32_t checkIntersection(const AlignedBox3f& box, uint32_t mask);
+    void testLeaf(BVH* node, uint32_t mask, float* nextParam, int* faceIndex, float* minU, float* minV);
+
+    static void trace(Scene& scene, int count, const Vector3f* origins, const Vector3f* directions, RayHit* hits);
+};
@@ -0,0 +1,261 @@
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include "pngwriter.hpp"
+
+static const int outputSize = 1 << 16;
+
+static void putBigEndian(unsigned char* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static void filterRow(const unsigned char* row, const unsigned char* previousRow, int size, unsigned char* best, unsigned char* scratch) {
+    // Pick the filter with the smallest sum of absolute residuals, as stb_image_write does.
+    // previousRow is NULL for the first row.
+    long long bestSum = -1;
+    for (int filter = 0; filter < 5; filter++) {
+        scratch[0] = filter;
+        long long sum = 0;
+        for (int i = 0; i < size; i++) {
+            int a = i >= 3 ? row[i - 3] : 0;
+            int b = previousRow != NULL ? previousRow[i] : 0;
+            int c = i >= 3 && previousRow != NULL ? previousRow[i - 3] : 0;
+            int predicted = 0;
+            if (filter == 1) predicted = a;
+            else if (filter == 2) predicted = b;
+            else if (filter == 3) predicted = (a + b) >> 1;
+            else if (filter == 4) predicted = paeth(a, b, c);
+            unsigned char residual = row[i] - predicted;
+            scratch[i + 1] = residual;
+            sum += abs((signed char) residual);
+        }
+        if (bestSum < 0 || sum < bestSum) {
+            bestSum = sum;
+            copy(scratch, scratch + size + 1, best);
+        }
+    }
+}
+
+PngWriter::PngWriter() {
+    this->file = NULL;
+    this->streamOpen = false;
+    this->width = 0;
+    this->height = 0;
+    this->rowsWritten = 0;
+    this->level = Z_DEFAULT_COMPRESSION;
+}
+
+PngWriter::~PngWriter() {
+    if (this->streamOpen) {
+        deflateEnd(&this->stream);
+    }
+    if (this->file != NULL) {
+        fclose(this->file);
+    }
+}
+
+int PngWriter::open(const string& filename, int width, int height) {
+    this->file = fopen(filename.c_str(), "wb");
+    if (this->file == NULL) {
+        return -1;
+    }
+    this->width = width;
+    this->height = height;
+    this->rowsWritten = 0;
+    this->previousRow.assign(width * 3, 0);
+    this->filteredRow.resize(width * 3 + 1);
+    this->bestRow.resize(width * 3 + 1);
+    this->output.resize(outputSize);
+
+    this->stream = z_stream();
+    if (deflateInit(&this->stream, this->level) != Z_OK) {
+        return -1;
+    }
+    this->streamOpen = true;
+    return writeHeader();
+}
+
+int PngWriter::writeHeader() {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (fwrite(signature, 1, 8, this->file) != 8) {
+        return -1;
+    }
+    // Width, height, 8 bits, RGB, deflate, adaptive filtering, no interlace
+    unsigned char header[13] = {0};
+    putBigEndian(header, this->width);
+    putBigEndian(header + 4, this->height);
+    header[8] = 8;
+    header[9] = 2;
+    return writeChunk("IHDR", header, 13);
+}
+
+int PngWriter::writeRow(const unsigned char* row) {
+    int size = this->width * 3;
+    filterRow(row, this->rowsWritten > 0 ? &this->previousRow[0] : NULL, size, &this->bestRow[0], &this->filteredRow[0]);
+    this->previousRow.assign(row, row + size);
+
+    this->stream.next_in = &this->bestRow[0];
+    this->stream.avail_in = size + 1;
+    this->rowsWritten++;
+    return flushOutput(Z_NO_FLUSH);
+}
+
+int PngWriter::close() {
+    // Rows never written are black
+    vector<unsigned char> black(this->width * 3, 0);
+    while (this->rowsWritten < this->height) {
+        if (writeRow(&black[0]) != 0) {
+            return -1;
+        }
+    }
+    int result = flushOutput(Z_FINISH);
+    deflateEnd(&this->stream);
+    this->streamOpen = false;
+    if (result == 0) {
+        result = writeChunk("IEND", NULL, 0);
+    }
+    if (fclose(this->file) != 0) {
+        result = -1;
+    }
+    this->file = NULL;
+    return result;
+}
+
+int PngWriter::flushOutput(int flush) {
+    // Compress the pending input, writing an IDAT chunk whenever the output buffer is full
+    while (true) {
+        this->stream.next_out = &this->output[0];
+        this->stream.avail_out = outputSize;
+        int status = deflate(&this->stream, flush);
+        if (status == Z_STREAM_ERROR) {
+            return -1;
+        }
+        int produced = outputSize - this->stream.avail_out;
+        if (produced > 0 && writeChunk("IDAT", &this->output[0], produced) != 0) {
+            return -1;
+        }
+        if (flush == Z_FINISH ? status == Z_STREAM_END : this->stream.avail_out > 0) {
+            return 0;
+        }
+    }
+}
+
+int PngWriter::writeChunk(const char type[4], const unsigned char* data, uint32_t size) {
+    unsigned char header[8];
+    putBigEndian(header, size);
+    for (int i = 0; i < 4; i++) {
+        header[4 + i] = type[i];
+    }
+    uLong crc = crc32(0, header + 4, 4);
+    if (size > 0) {
+        crc = crc32(crc, data, size);
+    }
+    unsigned char footer[4];
+    putBigEndian(footer, crc);
+    if (fwrite(header, 1, 8, this->file) != 8) {
+        return -1;
+    }
+    if (size > 0 && fwrite(data, 1, size, this->file) != size) {
+        return -1;
+    }
+    return fwrite(footer, 1, 4, this->file) == 4 ? 0 : -1;
+}
+
+static void compressBand(const unsigned char* pixels, int width, int rowBegin, int rowEnd, bool last, int level, vector<unsigned char>& output, uLong& adler) {
+    // Filtered rows [rowBegin, rowEnd) as raw deflate data ending on a byte boundary, so that the
+    // bands can be concatenated, and the Adler-32 of the filtered rows
+    int size = width * 3;
+    vector<unsigned char> filtered((rowEnd - rowBegin) * (size + 1));
+    vector<unsigned char> scratch(size + 1);
+    for (int i = rowBegin; i < rowEnd; i++) {
+        filterRow(pixels + (size_t) i * size, i > 0 ? pixels + (size_t) (i - 1) * size : NULL, size, &filtered[(i - rowBegin) * (size + 1)], &scratch[0]);
+    }
+    adler = adler32(adler32(0, NULL, 0), &filtered[0], filtered.size());
+
+    z_stream stream = z_stream();
+    output.clear();
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+    output.resize(deflateBound(&stream, filtered.size()) + 16);
+    stream.next_in = &filtered[0];
+    stream.avail_in = filtered.size();
+    stream.next_out = &output[0];
+    stream.avail_out = output.size();
+    int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (status == Z_STREAM_ERROR || stream.avail_in > 0) {
+        output.clear();
+    }
+    else {
+        output.resize(output.size() - stream.avail_out);
+    }
+    deflateEnd(&stream);
+}
+
+int PngWriter::write(const string& filename, int width, int height, const unsigned char* pixels, int level) {
+    PngWriter png;
+    png.file = fopen(filename.c_str(), "wb");
+    if (png.file == NULL) {
+        return -1;
+    }
+    png.width = width;
+    png.height = height;
+    if (png.writeHeader() != 0) {
+        return -1;
+    }
+
+    // One band per thread, at least 16 rows each
+    int bandCount = max(1, min((int) thread::hardware_concurrency(), height / 16));
+    vector<vector<unsigned char> > bands(bandCount);
+    vector<uLong> adlers(bandCount);
+    vector<thread> threads;
+    for (int b = 0; b < bandCount; b++) {
+        int rowBegin = (long long) height * b / bandCount;
+        int rowEnd = (long long) height * (b + 1) / bandCount;
+        threads.push_back(thread(compressBand, pixels, width, rowBegin, rowEnd, b == bandCount - 1, level, ref(bands[b]), ref(adlers[b])));
+    }
+    for (int b = 0; b < bandCount; b++) {
+        threads[b].join();
+    }
+
+    // zlib header, the bands in order and the combined Adler-32
+    static const unsigned char zlibHeader[2] = {0x78, 0x9C};
+    uLong adler = adlers[0];
+    for (int b = 1; b < bandCount; b++) {
+        int rows = (long long) height * (b + 1) / bandCount - (long long) height * b / bandCount;
+        adler = adler32_combine(adler, adlers[b], (z_off_t) rows * (width * 3 + 1));
+    }
+    unsigned char zlibFooter[4];
+    putBigEndian(zlibFooter, adler);
+    int result = png.writeChunk("IDAT", zlibHeader, 2);
+    for (int b = 0; b < bandCount && result == 0; b++) {
+        if (bands[b].empty()) {
+            result = -1;
+        }
+        for (size_t offset = 0; offset < bands[b].size() && result == 0; offset += outputSize) {
+            result = png.writeChunk("IDAT", &bands[b][offset], min((size_t) outputSize, bands[b].size() - offset));
+        }
+    }
+    if (result == 0) {
+        result = png.writeChunk("IDAT", zlibFooter, 4);
+    }
+    if (result == 0) {
+        result = png.writeChunk("IEND", NULL, 0);
+    }
+    if (fclose(png.file) != 0) {
+        result = -1;
+    }
+    png.file = NULL;
+    return result;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <zlib.h>
+
+using namespace std;
+
+// PNG encoder fed one row at a time.
+// Rows are filtered and compressed as they arrive and the compressed data is written out in
+// IDAT chunks, so only the previous row and the compressor state are kept in memory.
+//
+// PngWriter::write encodes a whole image instead, compressing bands of rows on several threads
+// into one zlib stream.
+
+class PngWriter {
+    public:
+    FILE* file;
+    z_stream stream;
+    bool streamOpen;
+    int width;
+    int height;
+    int rowsWritten;
+    // zlib level, 0 (stored) to 9
+    int level;
+    // RGB, 8 bits per channel
+    vector<unsigned char> previousRow;
+    vector<unsigned char> filteredRow;
+    vector<unsigned char> bestRow;
+    vector<unsigned char> output;
+
+    PngWriter();
+    ~PngWriter();
+    int open(const string& filename, int width, int height);
+    int writeRow(const unsigned char* row);
+    int close();
+
+    // RGB pixels, rows top to bottom
+    static int write(const string& filename, int width, int height, const unsigned char* pixels, int level);
+
+    int writeHeader();
+    int writeChunk(const char type[4], const unsigned char* data, uint32_t size);
+    int flushOutput(int flush);
+};
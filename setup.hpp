@@ -0,0 +1,10 @@
+#pragma once
+#include "surface.hpp"
+#include "animation.hpp"
+
+// Scene and camera of the final render, shared by the renderer, its workers and the benchmarks
+void setupScene(Scene& scene);
+void setupCamera(Camera& camera);
+
+// Turntable of the camera over animation.frameCount frames
+void setupAnimation(Animation& animation, Camera& camera);
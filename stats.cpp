@@ -0,0 +1,150 @@
+#include <fstream>
+#include <mutex>
+#include <algorithm>
+#include "stats.hpp"
+
+bool RenderStats::enabled = false;
+
+static const char* phaseNames[RenderStats::PHASE_COUNT] = {"load", "tessellate", "build", "render", "encode", "denoise"};
+
+// Counters of every thread, and the merged counters of threads that have exited
+static mutex registryMutex;
+static vector<RenderStats*> registry;
+static RenderStats retired;
+
+class ThreadStats {
+    public:
+    RenderStats stats;
+    // Depth of the running phase timers
+    int phaseDepth;
+
+    ThreadStats() {
+        this->phaseDepth = 0;
+        lock_guard<mutex> lock(registryMutex);
+        registry.push_back(&this->stats);
+    }
+    ~ThreadStats() {
+        lock_guard<mutex> lock(registryMutex);
+        retired.merge(this->stats);
+        registry.erase(find(registry.begin(), registry.end(), &this->stats));
+    }
+};
+
+static thread_local ThreadStats threadStats;
+
+RenderStats::RenderStats() {
+    this->clear();
+}
+
+void RenderStats::clear() {
+    this->primaryRays = 0;
+    this->secondaryRays = 0;
+    this->shadowRays = 0;
+    this->nodesVisited = 0;
+    this->boxTests = 0;
+    this->triangleTests = 0;
+    this->sphereTests = 0;
+    this->textureLookups = 0;
+    this->pathLengths.clear();
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        this->phaseSeconds[i] = 0;
+    }
+}
+
+void RenderStats::merge(const RenderStats& other) {
+    this->primaryRays += other.primaryRays;
+    this->secondaryRays += other.secondaryRays;
+    this->shadowRays += other.shadowRays;
+    this->nodesVisited += other.nodesVisited;
+    this->boxTests += other.boxTests;
+    this->triangleTests += other.triangleTests;
+    this->sphereTests += other.sphereTests;
+    this->textureLookups += other.textureLookups;
+    if (this->pathLengths.size() < other.pathLengths.size()) {
+        this->pathLengths.resize(other.pathLengths.size(), 0);
+    }
+    for (int i = 0; i < other.pathLengths.size(); i++) {
+        this->pathLengths[i] += other.pathLengths[i];
+    }
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        this->phaseSeconds[i] += other.phaseSeconds[i];
+    }
+}
+
+void RenderStats::addPathLength(int length) {
+    if (length >= this->pathLengths.size()) {
+        this->pathLengths.resize(length + 1, 0);
+    }
+    this->pathLengths[length]++;
+}
+
+int RenderStats::writeReport(const string& filename) {
+    ofstream outfile(filename);
+    if (!outfile.is_open()) {
+        return -1;
+    }
+    outfile << "{\n";
+    outfile << "  \"primaryRays\": " << this->primaryRays << ",\n";
+    outfile << "  \"secondaryRays\": " << this->secondaryRays << ",\n";
+    outfile << "  \"shadowRays\": " << this->shadowRays << ",\n";
+    outfile << "  \"nodesVisited\": " << this->nodesVisited << ",\n";
+    outfile << "  \"boxTests\": " << this->boxTests << ",\n";
+    outfile << "  \"triangleTests\": " << this->triangleTests << ",\n";
+    outfile << "  \"sphereTests\": " << this->sphereTests << ",\n";
+    outfile << "  \"textureLookups\": " << this->textureLookups << ",\n";
+    outfile << "  \"pathLengths\": [";
+    for (int i = 0; i < this->pathLengths.size(); i++) {
+        outfile << (i > 0 ? ", " : "") << this->pathLengths[i];
+    }
+    outfile << "],\n";
+    outfile << "  \"phaseSeconds\": {";
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        outfile << (i > 0 ? ", " : "") << "\"" << phaseNames[i] << "\": " << this->phaseSeconds[i];
+    }
+    outfile << "}\n}\n";
+    return outfile.good() ? 0 : -1;
+}
+
+RenderStats& RenderStats::local() {
+    return threadStats.stats;
+}
+
+RenderStats RenderStats::collect() {
+    lock_guard<mutex> lock(registryMutex);
+    RenderStats total = retired;
+    for (auto it = registry.begin(); it != registry.end(); it++) {
+        total.merge(**it);
+    }
+    return total;
+}
+
+void RenderStats::reset() {
+    lock_guard<mutex> lock(registryMutex);
+    retired.clear();
+    for (auto it = registry.begin(); it != registry.end(); it++) {
+        (*it)->clear();
+    }
+}
+
+PhaseTimer::PhaseTimer(RenderStats::Phase phase) {
+    this->phase = phase;
+    this->active = RenderStats::enabled;
+    this->nested = false;
+    if (this->active) {
+        this->nested = threadStats.phaseDepth++ > 0;
+        this->start = chrono::steady_clock::now();
+    }
+}
+
+PhaseTimer::~PhaseTimer() {
+    this->stop();
+}
+
+void PhaseTimer::stop() {
+    if (!this->active) return;
+    this->active = false;
+    threadStats.phaseDepth--;
+    if (!this->nested) {
+        threadStats.stats.phaseSeconds[this->phase] += chrono::duration<double>(chrono::steady_clock::now() - this->start).count();
+    }
+}
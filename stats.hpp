@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <chrono>
+
+using namespace std;
+
+// Render statistics.
+// Hot paths add to the counters of the calling thread (RenderStats::local) only while
+// RenderStats::enabled is set, and RenderStats::collect merges the counters of all threads.
+// Building with -DNO_RENDER_STATS removes the counting code altogether.
+
+class RenderStats {
+    public:
+    enum Phase {
+        PHASE_LOAD,
+        PHASE_TESSELLATE,
+        PHASE_BUILD,
+        PHASE_RENDER,
+        PHASE_ENCODE,
+        PHASE_DENOISE,
+        PHASE_COUNT
+    };
+
+    long long primaryRays;
+    long long secondaryRays;
+    long long shadowRays;
+    // Per ray : nodes entered, bounding boxes and primitives tested
+    long long nodesVisited;
+    long long boxTests;
+    long long triangleTests;
+    long long sphereTests;
+    long long textureLookups;
+
+    // Number of finished paths by closest hit rays traced
+    vector<long long> pathLengths;
+
+    double phaseSeconds[PHASE_COUNT];
+
+    static bool enabled;
+
+    RenderStats();
+    void clear();
+    void merge(const RenderStats& other);
+    void addPathLength(int length);
+    int writeReport(const string& filename);
+
+    static RenderStats& local();
+    static RenderStats collect();
+    static void reset();
+};
+
+class PhaseTimer {
+    // Adds its lifetime to a phase of the calling thread, timers nested in another one are ignored
+    public:
+    RenderStats::Phase phase;
+    bool active;
+    bool nested;
+    chrono::steady_clock::time_point start;
+
+    PhaseTimer(RenderStats::Phase phase);
+    ~PhaseTimer();
+    void stop();
+};
+
+#ifdef NO_RENDER_STATS
+#define STATS_ADD(counter, n) do {} while (0)
+#define STATS_PATH(length) do {} while (0)
+#else
+#define STATS_ADD(counter, n) do { if (RenderStats::enabled) RenderStats::local().counter += (n); } while (0)
+#define STATS_PATH(length) do { if (RenderStats::enabled) RenderStats::local().addPathLength(length); } while (0)
+#endif
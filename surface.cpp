@@ -5,9 +5,21 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <thread>
+#include <emmintrin.h>
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Geometry>
 #include "surface.hpp"
+#include "wavefront.hpp"
+#include "packet.hpp"
+#include "stats.hpp"
+#include "pngwriter.hpp"
+#include "denoise.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -33,6 +45,11 @@ void Light::setSpotLight(Vector3f color, Vector3f position, Vector3f direction,
     this->direction = direction.normalized();
     this->spotSize = min(max(spotSize, 0.0f), (float) M_PI / 2);
     this->exponent = exponent;
+    precompute();
+}
+
+void Light::precompute() {
+    this->cosSpotSize = this->lightType == LIGHT_SPOT ? cos(this->spotSize) : -1;
 }
 
 Material::Material() {
@@ -52,6 +69,7 @@ void Material::setDefaultMaterial() {
 }
 
 int Material::loadMaterial(const string &filename, vector<Material> &materials) {
+    PhaseTimer timer(RenderStats::PHASE_LOAD);
     int index = -1;
     Material material;
     string line;
@@ -161,6 +179,7 @@ void Object::clearModel() {
 }
 
 int Object::loadModel(const string& filename) {
+    PhaseTimer timer(RenderStats::PHASE_LOAD);
     string line;
     ifstream infile(filename);
     istringstream iss;
@@ -439,6 +458,7 @@ Vector3f Section::getGlobalPosition(int index) {
 }
 
 int SweptSurface::loadModel(const string& filename, int level, Material material) {
+    PhaseTimer timer(RenderStats::PHASE_TESSELLATE);
     string line;
     ifstream infile(filename);
 
@@ -646,6 +666,31 @@ void Scene::loadObject(Object& object) {
     }
 }
 
+int Scene::loadMesh(Object& object) {
+    // Shared geometry, placed in the scene by loadInstance
+    this->meshes.emplace_back();
+    Mesh& mesh = this->meshes.back();
+    mesh.faceVertices = object.faceVertices;
+    mesh.faceNormals = object.faceNormals;
+    mesh.faceUVs = object.faceUVs;
+    for (auto it = object.faceMaterialIndex.begin(); it != object.faceMaterialIndex.end(); it++) {
+        mesh.faceMaterialIndex.push_back(this->materials.size() + (*it));
+    }
+    for (auto it = object.materials.begin(); it != object.materials.end(); it++) {
+        this->materials.push_back(*it);
+    }
+    return this->meshes.size() - 1;
+}
+
+void Scene::loadInstance(int meshIndex, const Affine3f& transform) {
+    MeshInstance instance;
+    instance.meshIndex = meshIndex;
+    instance.transform = transform;
+    instance.inverse = transform.inverse();
+    instance.normalMatrix = transform.linear().inverse().transpose();
+    this->instances.push_back(instance);
+}
+
 void Scene::loadSphere(Vector3f position, float radius, Material material) {
     loadSphere(position, radius, material, Quaternionf());
 }
@@ -660,109 +705,164 @@ void Scene::loadSphere(Vector3f position, float radius, Material material, Quate
 
 void Scene::loadLight(Light& light) {
     this->lights.push_back(light);
+    this->lights.back().precompute();
 }
 
 void Scene::setBackgroundLight(Vector3f light) {
     this->backgroundLight = light;
 }
 
-void Scene::buildBVH() {
-    this->bvh.build(this->faceVertices);
+Scene::Scene() {
+    this->bvhBuildCost = 0;
+    this->bvhRebuildRatio = 1.5f;
+    this->lightSamples = 0;
+    this->minLightContribution = 0;
 }
 
-bool Scene::rayTrace(Vector3f origin, Vector3f direction) {
-    float nextParam;
-    int nextIndex;
-    Vector3f nextNormal;
-    Vector2f nextUV;
-    return rayTrace(origin, direction, nextParam, nextIndex, nextNormal, nextUV);
+static void buildInstanceBVH(Scene& scene) {
+    // Top level : every instance is given as the triangle (min, max, center) of its world box,
+    // which has the same bounds and centroid
+    vector<Vector3f> instanceBoxes;
+    for (auto it = scene.instances.begin(); it != scene.instances.end(); it++) {
+        AlignedBox3f& meshBox = scene.meshes[it->meshIndex].bvh.box;
+        AlignedBox3f box;
+        if (!meshBox.isEmpty()) {
+            for (int corner = 0; corner < 8; corner++) {
+                box.extend(it->transform * meshBox.corner((AlignedBox3f::CornerType) corner));
+            }
+        }
+        instanceBoxes.push_back(box.min());
+        instanceBoxes.push_back(box.max());
+        instanceBoxes.push_back(box.center());
+    }
+    // Leaves are instances, traced through their own meshes, so no triangle blocks
+    scene.instanceBVH.build(instanceBoxes, false);
 }
 
-bool Scene::rayTrace(Vector3f origin, Vector3f direction, float& nextParam) {
-    int nextIndex;
-    Vector3f nextNormal;
-    Vector2f nextUV;
-    return rayTrace(origin, direction, nextParam, nextIndex, nextNormal, nextUV);
+void Scene::buildBVH() {
+    PhaseTimer timer(RenderStats::PHASE_BUILD);
+    this->bvh.build(this->faceVertices);
+    this->bvhBuildCost = this->bvh.sahCost();
+
+    // One BVH per mesh, however many instances it has
+    for (auto it = this->meshes.begin(); it != this->meshes.end(); it++) {
+        it->bvh.build(it->faceVertices);
+        it->bvhBuildCost = it->bvh.sahCost();
+    }
+    buildInstanceBVH(*this);
+    buildLightTree();
 }
 
-bool Scene::rayTrace(Vector3f origin, Vector3f direction, float& nextParam, int& nextMatIndex, Vector3f& nextNormal, Vector2f& nextUV) {
-    vector<Vector3f> verts;
-    vector<int> indices;
-    vector<BVH*> bvhStack;
-    BVH* bvhCurrent = &this->bvh;
+void Scene::buildLightTree() {
+    // Again whenever lights move
+    this->lightTree.build(this->lights);
+}
 
-    nextMatIndex = -1;
+void Scene::updateBVH() {
+    // After moving faceVertices (or the vertices of meshes, or instance transforms) without changing the triangle count.
+    // Refitting keeps the tree, so it degrades as triangles move away from their neighbors :
+    // a BVH whose cost grew past bvhRebuildRatio is built again.
+    PhaseTimer timer(RenderStats::PHASE_BUILD);
+    int parallelDepth = 0;
+    while ((1 << parallelDepth) < (int) thread::hardware_concurrency()) {
+        parallelDepth++;
+    }
 
-    while (1) {
-        // Check intersection
-        if (bvhCurrent->checkIntersection(origin, direction)) {
-            if (bvhCurrent->isLeaf) {
-                indices.insert(indices.end(), bvhCurrent->indices.begin(), bvhCurrent->indices.end());
-                verts.insert(verts.end(), bvhCurrent->verts.begin(), bvhCurrent->verts.end());
-                if (bvhStack.empty()) break;
-                bvhCurrent = bvhStack.back();
-                bvhStack.pop_back();
-            }
-            else {
-                bvhStack.push_back(bvhCurrent->childL);
-                bvhCurrent = bvhCurrent->childR;
-            }
-        }
-        else {
-            if (bvhStack.empty()) break;
-            bvhCurrent = bvhStack.back();
-            bvhStack.pop_back();
+    this->bvh.refit(this->faceVertices, parallelDepth);
+    if (this->bvh.sahCost() > this->bvhBuildCost * this->bvhRebuildRatio) {
+        this->bvh.build(this->faceVertices);
+        this->bvhBuildCost = this->bvh.sahCost();
+    }
+    for (auto it = this->meshes.begin(); it != this->meshes.end(); it++) {
+        it->bvh.refit(it->faceVertices, parallelDepth);
+        if (it->bvh.sahCost() > it->bvhBuildCost * this->bvhRebuildRatio) {
+            it->bvh.build(it->faceVertices);
+            it->bvhBuildCost = it->bvh.sahCost();
         }
     }
 
-    int index = -1;
-    float minU, minV;
-    nextParam = numeric_limits<float>::max();
+    // Few nodes, always rebuilt
+    buildInstanceBVH(*this);
+}
+
+bool Scene::rayTrace(Vector3f origin, Vector3f direction) {
+    PrimitiveHit hit;
+    return tracePrimitive(origin, direction, hit);
+}
 
-    for (int i = 0; i < verts.size(); i += 3) {
-        Vector3f& base = verts[i];
-        Vector3f v1 = verts[i+1] - base;
-        Vector3f v2 = verts[i+2] - base;
-        Vector3f directionV2 = direction.cross(v2);
-        float det = v1.dot(directionV2);
-        
-        if (abs(det) < __FLT_EPSILON__) continue;
+bool Scene::rayTrace(Vector3f origin, Vector3f direction, float& nextParam) {
+    // Distance only, no attributes
+    PrimitiveHit hit;
+    bool collided = tracePrimitive(origin, direction, hit);
+    nextParam = hit.dist;
+    return collided;
+}
 
-        float invDet = 1 / det;
+bool Scene::rayTrace(Vector3f origin, Vector3f direction, float& nextParam, int& nextMatIndex, Vector3f& nextNormal, Vector2f& nextUV) {
+    PrimitiveHit hit;
+    nextMatIndex = -1;
+    bool collided = tracePrimitive(origin, direction, hit);
+    nextParam = hit.dist;
+    if (collided) {
+        hitAttributes(origin, direction, hit, nextMatIndex, nextNormal, nextUV);
+    }
+    return collided;
+}
 
-        Vector3f target = origin - base;
-        float u = target.dot(directionV2) * invDet;
-        if (u < 0 || u > 1) continue;
+PrimitiveHit::PrimitiveHit() {
+    this->dist = numeric_limits<float>::max();
+    this->instanceIndex = -1;
+    this->faceIndex = -1;
+    this->u = 0;
+    this->v = 0;
+    this->sphereIndex = -1;
+}
 
-        Vector3f targetV1 = target.cross(v1);
-        float v = direction.dot(targetV1) * invDet;
-        if (v < 0 || u + v > 1) continue;
+bool PrimitiveHit::collided() {
+    return this->faceIndex >= 0 || this->sphereIndex >= 0;
+}
 
-        float t = v2.dot(targetV1) * invDet;
-        if (t < nextParam & t > 1e-5) {
-            nextParam = t;
-            minU = u;
-            minV = v;
-            index = i;
-        }
+bool Scene::tracePrimitive(const Vector3f& origin, const Vector3f& direction, PrimitiveHit& hit) {
+    // Triangles of the scene, then of the instances, then the spheres
+    this->bvh.trace(origin, direction, hit.dist, hit.faceIndex, hit.u, hit.v);
+    if (!this->instances.empty()) {
+        traceInstances(origin, direction, hit.dist, hit.instanceIndex, hit.faceIndex, hit.u, hit.v);
     }
+    traceSpheres(origin, direction, hit);
+    return hit.collided();
+}
 
-    if (index >= 0) {
-        int faceIndex = indices[index / 3];
-        nextMatIndex = this->faceMaterialIndex[faceIndex];
-        nextNormal = 
-            faceNormals[faceIndex * 3] * (1 - minU - minV) 
-            + faceNormals[faceIndex * 3 + 1] * minU
-            + faceNormals[faceIndex * 3 + 2] * minV;
-        nextNormal.normalize();
-        nextUV =
-            faceUVs[faceIndex * 3] * (1 - minU - minV)
-            + faceUVs[faceIndex * 3 + 1] * minU
-            + faceUVs[faceIndex * 3 + 2] * minV;
-
+void Scene::traceInstances(const Vector3f& origin, const Vector3f& direction, float& nextParam, int& instanceIndex, int& faceIndex, float& minU, float& minV) {
+    // Top-level traversal, the ray is moved to object space for the mesh of every instance hit.
+    // The direction is not normalized again, so distances stay comparable with the scene triangles.
+    BVH* bvhStack[BVH::maxDepth];
+    int stackSize = 0;
+    bvhStack[stackSize++] = &this->instanceBVH;
+    while (stackSize > 0) {
+        BVH* node = bvhStack[--stackSize];
+        if (!node->checkIntersection(origin, direction)) continue;
+        STATS_ADD(nodesVisited, 1);
+        if (!node->isLeaf) {
+            bvhStack[stackSize++] = node->childL;
+            bvhStack[stackSize++] = node->childR;
+            continue;
+        }
+        for (auto it = node->indices.begin(); it != node->indices.end(); it++) {
+            MeshInstance& instance = this->instances[*it];
+            Vector3f localOrigin = instance.inverse * origin;
+            Vector3f localDirection = instance.inverse.linear() * direction;
+            int localFace = -1;
+            this->meshes[instance.meshIndex].bvh.trace(localOrigin, localDirection, nextParam, localFace, minU, minV);
+            if (localFace >= 0) {
+                faceIndex = localFace;
+                instanceIndex = *it;
+            }
+        }
     }
+}
 
-    // Sphere logic
+void Scene::traceSpheres(const Vector3f& origin, const Vector3f& direction, PrimitiveHit& hit) {
+    STATS_ADD(sphereTests, this->sphereRadius.size());
     for (int i = 0; i < this->sphereRadius.size(); i++) {
         float radius = this->sphereRadius[i];
         Vector3f delta = spherePosition[i] - origin;
@@ -775,31 +875,74 @@ bool Scene::rayTrace(Vector3f origin, Vector3f direction, float& nextParam, int&
         }
         det = sqrt(det);
         float t = b - det;
-        if (t > 1e-5 && t < nextParam) {
-            nextParam = t;
-            nextMatIndex = this->sphereMaterialIndex[i];
-            nextNormal = (t * direction - delta).normalized();
-            Vector3f orientation = this->sphereUV[i] * nextNormal;
-            nextUV << atan2(orientation[1], orientation[0]) / 2 / M_PI, acos(orientation[2]) / M_PI;
+        if (t > 1e-5 && t < hit.dist) {
+            hit.dist = t;
+            hit.sphereIndex = i;
         }
         t = b + det;
-        if (t > 1e-5 && t < nextParam) {
-            nextParam = t;
-            nextMatIndex = this->sphereMaterialIndex[i];
-            nextNormal = (t * direction - delta).normalized();
-            Vector3f orientation = this->sphereUV[i] * nextNormal;
-            nextUV << atan2(orientation[1], orientation[0]) / 2 / M_PI, acos(orientation[2]) / M_PI;
+        if (t > 1e-5 && t < hit.dist) {
+            hit.dist = t;
+            hit.sphereIndex = i;
         }
     }
+}
 
-    return (nextMatIndex >= 0);
+void Scene::hitAttributes(const Vector3f& origin, const Vector3f& direction, const PrimitiveHit& hit, int& matIndex, Vector3f& normal, Vector2f& uv) {
+    // Material, shading normal and UV of the final hit
+    if (hit.sphereIndex >= 0) {
+        int i = hit.sphereIndex;
+        Vector3f delta = spherePosition[i] - origin;
+        matIndex = this->sphereMaterialIndex[i];
+        normal = (hit.dist * direction - delta).normalized();
+        Vector3f orientation = this->sphereUV[i] * normal;
+        uv << atan2(orientation[1], orientation[0]) / 2 / M_PI, acos(orientation[2]) / M_PI;
+        return;
+    }
+
+    // Triangle of the scene, or of the mesh of an instance
+    int faceIndex = hit.faceIndex;
+    float minU = hit.u, minV = hit.v;
+    Mesh* mesh = hit.instanceIndex >= 0 ? &this->meshes[this->instances[hit.instanceIndex].meshIndex] : NULL;
+    vector<Vector3f>& normals = mesh ? mesh->faceNormals : this->faceNormals;
+    vector<Vector2f>& uvs = mesh ? mesh->faceUVs : this->faceUVs;
+    matIndex = mesh ? mesh->faceMaterialIndex[faceIndex] : this->faceMaterialIndex[faceIndex];
+    normal = 
+        normals[faceIndex * 3] * (1 - minU - minV) 
+        + normals[faceIndex * 3 + 1] * minU
+        + normals[faceIndex * 3 + 2] * minV;
+    if (mesh) {
+        normal = this->instances[hit.instanceIndex].normalMatrix * normal;
+    }
+    normal.normalize();
+    uv =
+        uvs[faceIndex * 3] * (1 - minU - minV)
+        + uvs[faceIndex * 3 + 1] * minU
+        + uvs[faceIndex * 3 + 2] * minV;
 }
 
-bool Scene::raySurface(Material& mat, Vector3f normal, Vector3f incoming, Vector2f uv, Vector3f& outgoing, Vector3f &weight) {
+bool Scene::completeHit(Vector3f origin, Vector3f direction, int instanceIndex, int faceIndex, float minU, float minV, float& nextParam, int& nextMatIndex, Vector3f& nextNormal, Vector2f& nextUV) {
+    // Nearest triangle already found (by PacketTracer) : test the spheres, then compute the attributes
+    PrimitiveHit hit;
+    hit.dist = nextParam;
+    hit.instanceIndex = instanceIndex;
+    hit.faceIndex = faceIndex;
+    hit.u = minU;
+    hit.v = minV;
+    traceSpheres(origin, direction, hit);
+    nextParam = hit.dist;
+    nextMatIndex = -1;
+    if (!hit.collided()) {
+        return false;
+    }
+    hitAttributes(origin, direction, hit, nextMatIndex, nextNormal, nextUV);
+    return true;
+}
+
+bool Scene::raySurface(Material& mat, Vector3f normal, Vector3f incoming, Vector2f uv, Vector3f& outgoing, Vector3f &weight, Sampler& sampler) {
     // Importance sampling
-    float p = (float) rand() / RAND_MAX;
-    float x = (float) rand() / RAND_MAX;
-    float y = (float) rand() / RAND_MAX;
+    float p = sampler.next();
+    float x = sampler.next();
+    float y = sampler.next();
     float yCos = cos(2 * M_PI * y);
     float ySin = sin(2 * M_PI * y);
 
@@ -864,62 +1007,160 @@ bool Scene::raySurface(Material& mat, Vector3f normal, Vector3f incoming, Vector
     return false;
 }
 
-Vector3f Scene::rayCollect(Material& mat, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv) {
-    // Collect from all lights
-    Vector3f totalIntensity;
-    totalIntensity << 0, 0, 0;
+bool Scene::lightOccluded(Light& light, Vector3f origin) {
+    // Shadow ray towards the light
+    STATS_ADD(shadowRays, 1);
+    if (light.lightType == Light::LIGHT_SUN) {
+        return rayTrace(origin, -light.direction);
+    }
+    Vector3f vec = light.position - origin;
+    float dist2 = vec.dot(vec), param;
+    bool collided = rayTrace(origin, vec.normalized(), param);
+    return collided && param * param < dist2;
+}
 
-    for (auto it = lights.begin(); it != lights.end(); it++) {
-        Light& light = *it;
-        Vector3f intensity;
-        Vector3f outgoing;
-        intensity << 0, 0, 0;
+Vector3f Scene::lightShade(Material& mat, Light& light, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv) {
+    // Contribution of an unoccluded light
+    Vector3f intensity;
+    Vector3f outgoing;
+    Vector3f totalIntensity;
+    intensity << 0, 0, 0;
 
-        if (light.lightType == Light::LIGHT_SUN) {
-            bool collided = rayTrace(origin, -light.direction);
-            if (collided) {
-                continue;
-            }
-            outgoing = -light.direction;
-            intensity = light.color;
+    if (light.lightType == Light::LIGHT_SUN) {
+        outgoing = -light.direction;
+        intensity = light.color;
+    }
+    else {
+        Vector3f vec = light.position - origin;
+        outgoing = vec.normalized();
+        float dist2 = vec.dot(vec);
+        if (light.lightType == Light::LIGHT_POINT) {
+            intensity = light.color / dist2;
         }
         else {
-            Vector3f vec = light.position - origin;
-            outgoing = vec.normalized();
-            float dist2 = vec.dot(vec), param;
-            bool collided = rayTrace(origin, outgoing, param);
-            if (collided && param * param < dist2) {
-                continue;
-            }
-            if (light.lightType == Light::LIGHT_POINT) {
-                intensity = light.color / dist2;
-            }
-            else {
-                // LIGHT_SPOT
-                float cosAngle = min(light.direction.dot(-outgoing), 1.0f);
-                float cosAngleMin = cos(light.spotSize);
-                if (cosAngle > cosAngleMin) {
-                    intensity = pow(cosAngle, light.exponent) * light.color / dist2;
-                }
+            // LIGHT_SPOT
+            float cosAngle = min(light.direction.dot(-outgoing), 1.0f);
+            if (cosAngle > light.cosSpotSize) {
+                intensity = pow(cosAngle, light.exponent) * light.color / dist2;
             }
         }
+    }
 
-        // Diffuse
-        if (mat.hasImgKd) {
-            totalIntensity += max(outgoing.dot(normal), 0.0f) * intensity.cwiseProduct(mat.imgKd.getValue(uv)) / M_PI;
+    // Diffuse
+    if (mat.hasImgKd) {
+        totalIntensity = max(outgoing.dot(normal), 0.0f) * intensity.cwiseProduct(mat.imgKd.getValue(uv)) / M_PI;
+    }
+    else {
+        totalIntensity = max(outgoing.dot(normal), 0.0f) * intensity.cwiseProduct(mat.Kd) / M_PI;
+    }
+
+    // Specular
+    Vector3f baseIncoming = -2 * outgoing.dot(normal) * normal + outgoing;
+    totalIntensity += (mat.Ns + 2) / 2 / M_PI * pow(max(0.0f, min(1.0f, baseIncoming.dot(incoming))), mat.Ns) * intensity.cwiseProduct(mat.Ks);
+    return totalIntensity;
+}
+
+bool Scene::lightNegligible(const Vector3f& intensity) {
+    // False for NaN, which is added as before
+    return intensity.maxCoeff() <= this->minLightContribution;
+}
+
+bool Scene::sampledLights() {
+    return this->lightSamples > 0 && !this->lightTree.nodes.empty();
+}
+
+Vector3f Scene::rayCollect(Material& mat, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv, Sampler& sampler) {
+    return rayCollect(mat, origin, normal, incoming, uv, sampler, Vector3f::Ones(), NULL);
+}
+
+Vector3f Scene::rayCollect(Material& mat, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv, Sampler& sampler, Vector3f weight, Vector3f* lightColors) {
+    // Collect from all lights, or from the sun lights and lightSamples lights picked by the light tree,
+    // weighted by the inverse of their probability. If lightColors is not NULL, the contribution of
+    // every light times weight is also added to lightColors[light].
+    Vector3f totalIntensity;
+    totalIntensity << 0, 0, 0;
+
+    bool sampled = sampledLights();
+    for (auto it = lights.begin(); it != lights.end(); it++) {
+        Light& light = *it;
+        if (sampled && light.lightType != Light::LIGHT_SUN) {
+            continue;
         }
-        else {
-            totalIntensity += max(outgoing.dot(normal), 0.0f) * intensity.cwiseProduct(mat.Kd) / M_PI;
+        // Shade first, and trace the shadow ray only for lights that contribute
+        Vector3f intensity = lightShade(mat, light, origin, normal, incoming, uv);
+        if (lightNegligible(intensity) || lightOccluded(light, origin)) {
+            continue;
+        }
+        totalIntensity += intensity;
+        if (lightColors != NULL) {
+            lightColors[it - lights.begin()] += intensity.cwiseProduct(weight);
+        }
+    }
+    for (int k = 0; sampled && k < this->lightSamples; k++) {
+        float pdf;
+        int l = this->lightTree.sample(origin, sampler.next(), pdf);
+        if (l < 0) {
+            continue;
+        }
+        Vector3f intensity = lightShade(mat, lights[l], origin, normal, incoming, uv) / (pdf * this->lightSamples);
+        if (lightNegligible(intensity) || lightOccluded(lights[l], origin)) {
+            continue;
+        }
+        totalIntensity += intensity;
+        if (lightColors != NULL) {
+            lightColors[l] += intensity.cwiseProduct(weight);
         }
-
-        // Specular
-        Vector3f baseIncoming = -2 * outgoing.dot(normal) * normal + outgoing;
-        totalIntensity += (mat.Ns + 2) / 2 / M_PI * pow(max(0.0f, min(1.0f, baseIncoming.dot(incoming))), mat.Ns) * intensity.cwiseProduct(mat.Ks);
     }
     return totalIntensity;
 }
 
+void Scene::hitFeatures(bool collided, float dist, int matIndex, Vector3f normal, Vector3f incoming, Vector2f uv, PathFeatures& features) {
+    // Albedo : fraction of the light the surface reflects or transmits, at most 1
+    if (!collided) {
+        features.albedo = this->backgroundLight.cwiseMin(Vector3f::Ones());
+        features.normal = Vector3f::Zero();
+        features.depth = INFINITY;
+        features.matIndex = -1;
+        return;
+    }
+    features.depth = dist;
+    features.matIndex = matIndex;
+    Material& mat = this->materials[matIndex];
+    Vector3f albedo = mat.hasImgKd ? mat.imgKd.getValue(uv) : mat.Kd;
+    albedo += mat.Ks;
+    if (mat.illumType == Material::ILLUM_REFRACTION) {
+        albedo += mat.Kr;
+    }
+    features.albedo = albedo.cwiseMin(Vector3f::Ones());
+    features.normal = normal.dot(incoming) > 0 ? -normal : normal;
+}
+
+static uint64_t mixBits(uint64_t z) {
+    // splitmix64 finalizer
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+Sampler::Sampler() {
+    this->state = 0;
+}
+
+Sampler::Sampler(unsigned int seed, int pixel, int sample) {
+    this->state = mixBits(mixBits(mixBits(seed) ^ (uint64_t) pixel) ^ (uint64_t) sample);
+}
+
+float Sampler::next() {
+    // Uniform in [0, 1)
+    this->state += 0x9E3779B97F4A7C15ULL;
+    return (mixBits(this->state) >> 40) * (1.0f / (1 << 24));
+}
+
 Camera::Camera() {
+    this->backend = BACKEND_PATH;
+    this->sortRays = false;
+    this->packetTracing = false;
+    this->maxCollision = 12;
     this->fovy = 50.0f;
     this->width = 160;
     this->height = 90;
@@ -929,80 +1170,1143 @@ Camera::Camera() {
     this->fNumber = 9999;
     this->planeDist = 1.0;
     this->focusDist = 10.0;
+    this->seed = 0;
+    this->firstSample = 0;
+    this->rowBegin = 0;
+    this->rowEnd = -1;
+    this->bufferOffset = 0;
+    this->streamRows = 0;
+    this->previewScale = 0;
+    this->previewUpscale = false;
+    this->cropOutput = false;
+    this->timeBudget = 0;
+    this->hdrOutput = false;
+    this->exposure = 0;
+    this->toneMapping = TONEMAP_CLAMP;
+    this->compressionLevel = 6;
+    this->checkpointInterval = 60.0f;
+    this->heatmaps = false;
+    this->denoise = false;
 }
 
-void Camera::sampleImage(Scene &scene, const string& filename) {
-    this->renderedImage.clear();
-    for (int i = 0; i < this->width * this->height * 3; i++) {
-        this->renderedImage.push_back(0);
+void Camera::clearImage() {
+    this->renderedImage.assign(this->width * this->height * 3, 0);
+    this->sampleCount.assign(this->width * this->height, 0);
+    this->clearAovs();
+    if (this->heatmaps) {
+        this->clearHeatmaps();
     }
+}
+
+int AovBuffer::parse(const string& name, AovBuffer& aov) {
+    static const char* names[] = {"depth", "normal", "albedo", "material", "direct", "indirect"};
+    static const int channels[] = {1, 3, 3, 1, 3, 3};
+    aov.name = name;
+    aov.light = -1;
+    aov.output = true;
+    for (int t = AOV_DEPTH; t <= AOV_INDIRECT; t++) {
+        if (name.compare(names[t]) == 0) {
+            aov.type = (AovType) t;
+            aov.channels = channels[t];
+            return 0;
+        }
+    }
+    // At most 9 digits, so that the index fits an int
+    if (name.compare(0, 5, "light") == 0 && name.size() > 5 && name.size() <= 14 && name.find_first_not_of("0123456789", 5) == string::npos) {
+        aov.type = AOV_LIGHT;
+        aov.light = atoi(name.c_str() + 5);
+        aov.channels = 3;
+        return 0;
+    }
+    return -1;
+}
+
+int Camera::addAov(const string& name, bool output) {
+    // Buffers are allocated by clearAovs
+    AovBuffer aov;
+    if (AovBuffer::parse(name, aov) != 0) {
+        return -1;
+    }
+    for (auto it = this->aovs.begin(); it != this->aovs.end(); it++) {
+        if (it->name == name) {
+            it->output = it->output || output;
+            return 0;
+        }
+    }
+    aov.output = output;
+    this->aovs.push_back(aov);
+    return 0;
+}
+
+int Camera::checkAovs(const Scene& scene) {
+    for (auto it = this->aovs.begin(); it != this->aovs.end(); it++) {
+        if (it->type == AovBuffer::AOV_LIGHT && it->light >= scene.lights.size()) {
+            cerr << "Unknown AOV " << it->name << ", the scene has " << scene.lights.size() << " lights" << endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+AovBuffer* Camera::findAov(AovBuffer::AovType type) {
+    for (auto it = this->aovs.begin(); it != this->aovs.end(); it++) {
+        if (it->type == type) return &*it;
+    }
+    return NULL;
+}
+
+void Camera::clearAovs() {
+    // Sized like the accumulation buffers if any AOV is used or while denoising, empty otherwise
+    if (this->denoise) {
+        addAov("albedo", false);
+        addAov("normal", false);
+    }
+    int size = this->aovs.empty() ? 0 : this->renderedImage.size() / 3;
+    for (auto it = this->aovs.begin(); it != this->aovs.end(); it++) {
+        it->values.assign(size * it->channels, it->type == AovBuffer::AOV_DEPTH ? INFINITY : 0);
+    }
+    this->aovCount.assign(size, 0);
+    this->luminanceMoments.assign(this->denoise ? size * 2 : 0, 0);
+}
+
+PathFeatures* Camera::featureRecord(Scene& scene, PathFeatures& features) {
+    // features ready to be filled by a path, NULL if no AOV is recorded
+    if (this->aovCount.empty()) {
+        return NULL;
+    }
+    int lightCount = 0;
+    for (auto it = this->aovs.begin(); it != this->aovs.end(); it++) {
+        if (it->type == AovBuffer::AOV_LIGHT) lightCount = scene.lights.size();
+    }
+    features.lightColors.assign(lightCount, Vector3f::Zero());
+    return &features;
+}
+
+void Camera::addSample(int pixel, const Vector3f& color, const PathFeatures* features) {
+    // Add a sample to the buffers, features is NULL if not recorded. The sample count is updated by the caller.
+    int index = pixel - this->bufferOffset;
+    renderedImage[index * 3 + 0] += color[0];
+    renderedImage[index * 3 + 1] += color[1];
+    renderedImage[index * 3 + 2] += color[2];
+    if (features == NULL || this->aovCount.empty()) {
+        return;
+    }
+    for (auto it = this->aovs.begin(); it != this->aovs.end(); it++) {
+        double* values = &it->values[index * it->channels];
+        Vector3f value = Vector3f::Zero();
+        switch (it->type) {
+            case AovBuffer::AOV_DEPTH:
+                values[0] = min(values[0], (double) features->depth);
+                continue;
+            case AovBuffer::AOV_MATERIAL:
+                if (this->aovCount[index] == 0) values[0] = features->matIndex;
+                continue;
+            case AovBuffer::AOV_NORMAL: value = features->normal; break;
+            case AovBuffer::AOV_ALBEDO: value = features->albedo; break;
+            case AovBuffer::AOV_DIRECT: value = features->direct; break;
+            case AovBuffer::AOV_INDIRECT: value = color - features->direct; break;
+            case AovBuffer::AOV_LIGHT:
+                value = it->light < features->lightColors.size() ? features->lightColors[it->light] : Vector3f::Zero();
+                break;
+        }
+        values[0] += value[0];
+        values[1] += value[1];
+        values[2] += value[2];
+    }
+    if (this->denoise) {
+        double luminance = 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+        this->luminanceMoments[index * 2 + 0] += luminance;
+        this->luminanceMoments[index * 2 + 1] += luminance * luminance;
+    }
+    this->aovCount[index]++;
+}
 
+void Camera::generateRay(int i, int j, Sampler& sampler, Vector3f& origin, Vector3f& direction) {
+    // Primary ray through pixel (i, j) with a random lens position
     float pxDist = tan(this->fovy * M_PI / 360) / this->height * 2;
     Matrix3f rotMat = this->orientation.toRotationMatrix();
     Vector3f cBase = -rotMat.col(2);
     Vector3f cXUnit = rotMat.col(0) * pxDist;
     Vector3f cYUnit = rotMat.col(1) * pxDist;
-    int imgIndex = 0;
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            for (int k = 0; k < sampleRate; k++) {
-                float yPixel = (i - height / 2.0) + (float) random() / RAND_MAX;
-                float xPixel = (j - width / 2.0) + (float) random() / RAND_MAX;
-
-                // Perturbation scale (in pixel) for DOF
-                float perturbScale = (this->planeDist / pxDist / this->fNumber) * sqrt((float) random() / RAND_MAX);
-                float perturbAngle = ((float) random() / RAND_MAX) * 2 * M_PI;
-                float xPerturb = perturbScale * cos(perturbAngle); 
-                float yPerturb = perturbScale * sin(perturbAngle); 
-
-                // Depth of field calculation
-                Vector3f currentDirection = (cBase + cXUnit * xPixel - cYUnit * yPixel).normalized();
-                Vector3f focalPoint = this->position + currentDirection * this->focusDist;
-                Vector3f currentPosition = this->position + (cBase + cXUnit * (xPixel + xPerturb) - cYUnit * (yPixel + yPerturb)) * this->planeDist;
-                currentDirection = (focalPoint - currentPosition).normalized();
-
-                int maxCollision = 12;
-                int index;
-                float dist;
-                Vector3f weight = Vector3f(1, 1, 1);
-                Vector3f nextDirection;
-                Vector3f normal;
-                Vector3f weightMult;
-                Vector2f uv;
-                
-                for (int collision = 1; collision <= maxCollision; collision++) {
-                    bool collided = scene.rayTrace(currentPosition, currentDirection, dist, index, normal, uv);
-                    if (!collided) {
-                        renderedImage[imgIndex + 0] += scene.backgroundLight[0] * weight[0];
-                        renderedImage[imgIndex + 1] += scene.backgroundLight[1] * weight[1];
-                        renderedImage[imgIndex + 2] += scene.backgroundLight[2] * weight[2];
-                        break;
-                    }
 
-                    currentPosition += currentDirection * dist;
-                    Material& mat = scene.materials[index];
-                    Vector3f shadowIntensity = scene.rayCollect(mat, currentPosition, normal, currentDirection, uv);
-                    renderedImage[imgIndex + 0] += shadowIntensity[0] * weight[0];
-                    renderedImage[imgIndex + 1] += shadowIntensity[1] * weight[1];
-                    renderedImage[imgIndex + 2] += shadowIntensity[2] * weight[2];
-                    if (!scene.raySurface(mat, normal, currentDirection, uv, nextDirection, weightMult)) {
-                        break;
+    float yPixel = (i - height / 2.0) + sampler.next();
+    float xPixel = (j - width / 2.0) + sampler.next();
+
+    // Perturbation scale (in pixel) for DOF
+    float perturbScale = (this->planeDist / pxDist / this->fNumber) * sqrt(sampler.next());
+    float perturbAngle = sampler.next() * 2 * M_PI;
+    float xPerturb = perturbScale * cos(perturbAngle); 
+    float yPerturb = perturbScale * sin(perturbAngle); 
+
+    // Depth of field calculation
+    direction = (cBase + cXUnit * xPixel - cYUnit * yPixel).normalized();
+    Vector3f focalPoint = this->position + direction * this->focusDist;
+    origin = this->position + (cBase + cXUnit * (xPixel + xPerturb) - cYUnit * (yPixel + yPerturb)) * this->planeDist;
+    direction = (focalPoint - origin).normalized();
+}
+
+Vector3f Camera::samplePixel(Scene &scene, int i, int j, int k, PathFeatures* features) {
+    // Trace the k-th sample of pixel (i, j), and record its first hit in features if not NULL
+    Sampler sampler(this->seed, i * this->width + j, k);
+    Vector3f currentPosition;
+    Vector3f currentDirection;
+    generateRay(i, j, sampler, currentPosition, currentDirection);
+    return tracePath(scene, sampler, currentPosition, currentDirection, NULL, features);
+}
+
+Vector3f Camera::tracePath(Scene &scene, Sampler& sampler, Vector3f currentPosition, Vector3f currentDirection, RayHit* primaryHit, PathFeatures* features) {
+    // Follow a path from the camera, primaryHit is the first hit if already traced
+    Vector3f color(0, 0, 0);
+    int index;
+    float dist;
+    Vector3f weight = Vector3f(1, 1, 1);
+    Vector3f nextDirection;
+    Vector3f normal;
+    Vector3f weightMult;
+    Vector2f uv;
+    Vector3f* lightColors = NULL;
+    if (features != NULL) {
+        features->direct = Vector3f::Zero();
+        fill(features->lightColors.begin(), features->lightColors.end(), Vector3f::Zero());
+        lightColors = features->lightColors.empty() ? NULL : &features->lightColors[0];
+    }
+    
+    for (int collision = 1; collision <= this->maxCollision; collision++) {
+        bool collided;
+        if (collision == 1 && primaryHit != NULL) {
+            collided = primaryHit->collided;
+            dist = primaryHit->dist;
+            index = primaryHit->matIndex;
+            normal = primaryHit->normal;
+            uv = primaryHit->uv;
+        }
+        else {
+            if (collision == 1) {
+                STATS_ADD(primaryRays, 1);
+            }
+            else {
+                STATS_ADD(secondaryRays, 1);
+            }
+            collided = scene.rayTrace(currentPosition, currentDirection, dist, index, normal, uv);
+        }
+        if (collision == 1 && features != NULL) {
+            scene.hitFeatures(collided, dist, index, normal, currentDirection, uv, *features);
+        }
+        if (!collided) {
+            color += scene.backgroundLight.cwiseProduct(weight);
+            if (collision == 1 && features != NULL) {
+                features->direct = color;
+            }
+            STATS_PATH(collision);
+            return color;
+        }
+
+        currentPosition += currentDirection * dist;
+        Material& mat = scene.materials[index];
+        Vector3f shadowIntensity = scene.rayCollect(mat, currentPosition, normal, currentDirection, uv, sampler, weight, lightColors);
+        color += shadowIntensity.cwiseProduct(weight);
+        if (collision == 1 && features != NULL) {
+            features->direct = color;
+        }
+        if (!scene.raySurface(mat, normal, currentDirection, uv, nextDirection, weightMult, sampler)) {
+            STATS_PATH(collision);
+            return color;
+        }
+        weight = weight.cwiseProduct(weightMult);
+        currentDirection = nextDirection;
+    }
+    STATS_PATH(this->maxCollision);
+    return color;
+}
+
+void Camera::samplePackets(Scene &scene, const vector<int>& pixels, int sample) {
+    // Group pixels into tiles and trace their primary rays as packets
+    int tileSize = PacketTracer::tileSize;
+    int tilesPerRow = (this->width + tileSize - 1) / tileSize;
+    vector<pair<int, int> > tilePixels;
+    for (auto it = pixels.begin(); it != pixels.end(); it++) {
+        int tile = (*it / this->width / tileSize) * tilesPerRow + (*it % this->width) / tileSize;
+        tilePixels.push_back({tile, *it});
+    }
+    sort(tilePixels.begin(), tilePixels.end());
+
+    vector<Sampler> samplers(PacketTracer::packetSize);
+    vector<Vector3f> origins(PacketTracer::packetSize);
+    vector<Vector3f> directions(PacketTracer::packetSize);
+    vector<RayHit> hits(PacketTracer::packetSize);
+    PathFeatures features;
+    PathFeatures* recorded = featureRecord(scene, features);
+    for (int begin = 0; begin < tilePixels.size(); ) {
+        int end = begin;
+        while (end < tilePixels.size() && tilePixels[end].first == tilePixels[begin].first) end++;
+
+        int count = end - begin;
+        for (int r = 0; r < count; r++) {
+            int pixel = tilePixels[begin + r].second;
+            samplers[r] = Sampler(this->seed, pixel, sample);
+            generateRay(pixel / this->width, pixel % this->width, samplers[r], origins[r], directions[r]);
+        }
+        PacketTracer::trace(scene, count, &origins[0], &directions[0], &hits[0]);
+        STATS_ADD(primaryRays, count);
+        for (int r = 0; r < count; r++) {
+            int pixel = tilePixels[begin + r].second;
+            Vector3f color = tracePath(scene, samplers[r], origins[r], directions[r], &hits[r], recorded);
+            addSample(pixel, color, recorded);
+        }
+        begin = end;
+    }
+}
+
+void Camera::samplePixels(Scene &scene, const vector<int>& pixels, int pass) {
+    // Add sample (firstSample + pass) to each pixel
+    PathFeatures features;
+    PathFeatures* recorded = featureRecord(scene, features);
+    if (this->heatmaps) {
+        // Cost of each sample from the counters of this thread, same traversal as the path backend
+        RenderStats& stats = RenderStats::local();
+        for (auto it = pixels.begin(); it != pixels.end(); it++) {
+            long long nodes = stats.nodesVisited;
+            long long triangles = stats.triangleTests;
+            auto start = chrono::steady_clock::now();
+            Vector3f color = samplePixel(scene, *it / width, *it % width, this->firstSample + pass, recorded);
+            this->heatSeconds[*it] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            this->heatNodes[*it] += stats.nodesVisited - nodes;
+            this->heatTriangles[*it] += stats.triangleTests - triangles;
+            this->heatSamples[*it]++;
+            addSample(*it, color, recorded);
+        }
+    }
+    else if (this->backend == BACKEND_WAVEFRONT) {
+        WavefrontRenderer wavefront;
+        wavefront.sortRays = this->sortRays;
+        wavefront.render(scene, *this, pixels, this->firstSample + pass);
+    }
+    else if (this->packetTracing) {
+        samplePackets(scene, pixels, this->firstSample + pass);
+    }
+    else {
+        for (auto it = pixels.begin(); it != pixels.end(); it++) {
+            Vector3f color = samplePixel(scene, *it / width, *it % width, this->firstSample + pass, recorded);
+            addSample(*it, color, recorded);
+        }
+    }
+    for (auto it = pixels.begin(); it != pixels.end(); it++) {
+        this->sampleCount[*it - this->bufferOffset]++;
+    }
+}
+
+static string replaceExtension(const string& filename, const string& extension) {
+    // Files written next to the image, result.png : result.stats.json
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return filename + extension;
+    }
+    return filename.substr(0, dot) + extension;
+}
+
+Vector3f Camera::previewPixel(Scene &scene, int i, int j) {
+    // First hit of sample 0 of pixel (i, j), lit by the lights without bounces
+    Sampler sampler(this->seed, i * this->width + j, 0);
+    Vector3f origin;
+    Vector3f direction;
+    generateRay(i, j, sampler, origin, direction);
+
+    float dist;
+    int index;
+    Vector3f normal;
+    Vector2f uv;
+    STATS_ADD(primaryRays, 1);
+    if (!scene.rayTrace(origin, direction, dist, index, normal, uv)) {
+        return scene.backgroundLight;
+    }
+    return scene.rayCollect(scene.materials[index], origin + direction * dist, normal, direction, uv, sampler);
+}
+
+void Camera::samplePreview(Scene &scene) {
+    // One preview sample per pixel of the whole image, rows interleaved over the threads
+    this->bufferOffset = 0;
+    this->clearImage();
+    int threadCount = max(1, min((int) thread::hardware_concurrency(), this->height));
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.push_back(thread([this, t, threadCount, &scene]() {
+            for (int i = t; i < this->height; i += threadCount) {
+                for (int j = 0; j < this->width; j++) {
+                    Vector3f color = this->previewPixel(scene, i, j);
+                    int pixel = i * this->width + j;
+                    this->renderedImage[pixel * 3 + 0] = color[0];
+                    this->renderedImage[pixel * 3 + 1] = color[1];
+                    this->renderedImage[pixel * 3 + 2] = color[2];
+                    this->sampleCount[pixel] = 1;
+                }
+            }
+        }));
+    }
+    for (int t = 0; t < threadCount; t++) {
+        threads[t].join();
+    }
+}
+
+void Camera::previewImage(Scene &scene, const string& filename) {
+    // Same view at the reduced resolution : generateRay keeps the field of view for any size
+    Camera preview = *this;
+    preview.width = max(1, this->width / max(this->previewScale, 1));
+    preview.height = max(1, this->height / max(this->previewScale, 1));
+    PhaseTimer timer(RenderStats::PHASE_RENDER);
+    preview.samplePreview(scene);
+    timer.stop();
+    if (RenderStats::enabled) {
+        RenderStats::collect().writeReport(replaceExtension(filename, ".stats.json"));
+    }
+    if (!this->previewUpscale || (preview.width == this->width && preview.height == this->height)) {
+        preview.writeImage(filename);
+        return;
+    }
+
+    // Bilinear, between the centers of the preview pixels
+    Camera full = preview;
+    full.width = this->width;
+    full.height = this->height;
+    full.clearImage();
+    for (int i = 0; i < full.height; i++) {
+        float y = min(max((i + 0.5f) * preview.height / full.height - 0.5f, 0.0f), preview.height - 1.0f);
+        int y0 = min((int) y, preview.height - 2 < 0 ? 0 : preview.height - 2);
+        int y1 = min(y0 + 1, preview.height - 1);
+        float fy = y - y0;
+        for (int j = 0; j < full.width; j++) {
+            float x = min(max((j + 0.5f) * preview.width / full.width - 0.5f, 0.0f), preview.width - 1.0f);
+            int x0 = min((int) x, preview.width - 2 < 0 ? 0 : preview.width - 2);
+            int x1 = min(x0 + 1, preview.width - 1);
+            float fx = x - x0;
+            for (int k = 0; k < 3; k++) {
+                double top = preview.renderedImage[(y0 * preview.width + x0) * 3 + k] * (1 - fx) + preview.renderedImage[(y0 * preview.width + x1) * 3 + k] * fx;
+                double bottom = preview.renderedImage[(y1 * preview.width + x0) * 3 + k] * (1 - fx) + preview.renderedImage[(y1 * preview.width + x1) * 3 + k] * fx;
+                full.renderedImage[(i * full.width + j) * 3 + k] = top * (1 - fy) + bottom * fy;
+            }
+            full.sampleCount[i * full.width + j] = 1;
+        }
+    }
+    full.writeImage(filename);
+}
+
+void Camera::sampleImage(Scene &scene, const string& filename) {
+    this->clearImage();
+    this->continueImage(scene, filename);
+}
+
+
+void Camera::continueImage(Scene &scene, const string& filename) {
+    // Render the samples missing from the accumulation buffer, one pass per sample index.
+    // Every sample is seeded by (seed, pixel, sample), so the order of passes does not matter.
+    if (this->renderedImage.size() != this->width * this->height * 3 || this->sampleCount.size() != this->width * this->height) {
+        this->clearImage();
+    }
+    else if (this->aovCount.size() != (this->aovs.empty() && !this->denoise ? 0 : this->sampleCount.size())) {
+        // Resumed samples have no AOVs, the buffers hold the new ones only
+        this->clearAovs();
+    }
+
+    // Per-pixel costs come from the render statistics, counted during this render only
+    bool statsEnabled = RenderStats::enabled;
+    if (this->heatmaps) {
+        RenderStats::enabled = true;
+        if (this->heatSamples.size() != this->width * this->height) {
+            this->clearHeatmaps();
+        }
+    }
+
+    int rowBegin = max(this->rowBegin, 0);
+    int rowEnd = this->rowEnd < 0 ? this->height : min(this->rowEnd, this->height);
+    if (rowBegin >= rowEnd) {
+        RenderStats::enabled = statsEnabled;
+        return;
+    }
+
+    PhaseTimer timer(RenderStats::PHASE_RENDER);
+    auto start = chrono::steady_clock::now();
+    this->renderRows(scene, rowBegin, rowEnd, this->timeBudget);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    timer.stop();
+    RenderStats::enabled = statsEnabled;
+
+    if (!filename.empty()) {
+        this->writeImage(filename);
+        if (this->timeBudget > 0) {
+            this->writeSampleReport(replaceExtension(filename, ".samples.json"), seconds);
+        }
+        if (RenderStats::enabled) {
+            RenderStats::collect().writeReport(replaceExtension(filename, ".stats.json"));
+        }
+        if (this->heatmaps) {
+            this->writeHeatmaps(filename);
+        }
+    }
+}
+
+void Camera::rowSpans(int row, vector<pair<int, int> >& spans) {
+    // Columns [first, second) of the row to render, sorted and disjoint
+    spans.clear();
+    if (this->regions.empty()) {
+        spans.push_back({0, this->width});
+        return;
+    }
+    for (auto it = this->regions.begin(); it != this->regions.end(); it++) {
+        int begin = max(it->x, 0);
+        int end = min(it->x + it->width, this->width);
+        if (row >= it->y && row < it->y + it->height && begin < end) {
+            spans.push_back({begin, end});
+        }
+    }
+    sort(spans.begin(), spans.end());
+    int merged = 0;
+    for (int s = 1; s < spans.size(); s++) {
+        if (spans[s].first <= spans[merged].second) {
+            spans[merged].second = max(spans[merged].second, spans[s].second);
+        }
+        else {
+            spans[++merged] = spans[s];
+        }
+    }
+    spans.resize(min((int) spans.size(), merged + 1));
+}
+
+bool Camera::inRegions(int i, int j) {
+    if (this->regions.empty()) {
+        return true;
+    }
+    for (auto it = this->regions.begin(); it != this->regions.end(); it++) {
+        if (j >= it->x && j < it->x + it->width && i >= it->y && i < it->y + it->height) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Camera::renderRows(Scene &scene, int rowBegin, int rowEnd, double budget) {
+    // Passes over the pixels of rows [rowBegin, rowEnd) in the regions, which must be held by the buffers.
+    // With a budget, a pass starts only if it is expected to end in time, and once every pixel has a new
+    // sample a pass is cut short when the time is up. Every pixel is averaged over its own count.
+    vector<pair<int, int> > spans;
+    int rowPixels = 0;
+    int pass = this->sampleRate;
+    for (int i = rowBegin; i < rowEnd; i++) {
+        this->rowSpans(i, spans);
+        int count = 0;
+        for (auto span = spans.begin(); span != spans.end(); span++) {
+            count += span->second - span->first;
+            for (int pixel = i * width + span->first; pixel < i * width + span->second; pixel++) {
+                pass = min(pass, this->sampleCount[pixel - this->bufferOffset]);
+            }
+        }
+        rowPixels = max(rowPixels, count);
+    }
+    if (rowPixels == 0) {
+        return;
+    }
+
+    // Rows rendered between checkpoint checks, large enough to fill a wavefront batch
+    int rowStep = max(1, (int) (WavefrontRenderer::batchSize / rowPixels));
+
+    auto start = chrono::steady_clock::now();
+    auto lastCheckpoint = start;
+    int passLimit = this->sampleRate > 0 || budget <= 0 ? this->sampleRate : INT_MAX;
+    int firstPass = pass;
+    double passSeconds = 0;
+    for (; pass < passLimit; pass++) {
+        auto passStart = chrono::steady_clock::now();
+        if (budget > 0 && pass > firstPass && chrono::duration<double>(passStart - start).count() + passSeconds > budget) {
+            break;
+        }
+        for (int i = rowBegin; i < rowEnd; i += rowStep) {
+            if (budget > 0 && pass > firstPass && chrono::duration<double>(chrono::steady_clock::now() - start).count() > budget) {
+                return;
+            }
+            vector<int> pixels;
+            for (int row = i; row < min(i + rowStep, rowEnd); row++) {
+                this->rowSpans(row, spans);
+                for (auto span = spans.begin(); span != spans.end(); span++) {
+                    for (int pixel = row * width + span->first; pixel < row * width + span->second; pixel++) {
+                        if (this->sampleCount[pixel - this->bufferOffset] == pass) {
+                            pixels.push_back(pixel);
+                        }
                     }
-                    weight = weight.cwiseProduct(weightMult);
-                    currentDirection = nextDirection;
                 }
             }
-            imgIndex += 3;
+            if (pixels.empty()) {
+                continue;
+            }
+            this->samplePixels(scene, pixels, pass);
+
+            if (!this->checkpointFilename.empty()) {
+                auto now = chrono::steady_clock::now();
+                if (chrono::duration<float>(now - lastCheckpoint).count() >= this->checkpointInterval) {
+                    this->saveCheckpoint(this->checkpointFilename);
+                    lastCheckpoint = now;
+                }
+            }
         }
+        passSeconds = chrono::duration<double>(chrono::steady_clock::now() - passStart).count();
     }
+}
 
-    vector<unsigned char> finalImage;
-    for (auto it = renderedImage.begin(); it != renderedImage.end(); it++) {
-        float value = (*it) / this->sampleRate;
-        finalImage.push_back(value > 1 ? 0xFF : (unsigned char)(pow(value, 1.0 / 2.2) * 0xFF));
+int Camera::writeSampleReport(const string& filename, double seconds) {
+    // Samples per pixel reached in the rendered rows and regions
+    int rowBegin = max(this->rowBegin, 0);
+    int rowEnd = this->rowEnd < 0 ? this->height : min(this->rowEnd, this->height);
+    int minCount = INT_MAX, maxCount = 0;
+    long long total = 0, pixels = 0;
+    vector<pair<int, int> > spans;
+    for (int i = rowBegin; i < rowEnd; i++) {
+        this->rowSpans(i, spans);
+        for (auto span = spans.begin(); span != spans.end(); span++) {
+            for (int pixel = i * this->width + span->first; pixel < i * this->width + span->second; pixel++) {
+                int count = this->sampleCount[pixel - this->bufferOffset];
+                minCount = min(minCount, count);
+                maxCount = max(maxCount, count);
+                total += count;
+                pixels++;
+            }
+        }
+    }
+    ofstream outfile(filename);
+    if (!outfile.is_open()) {
+        return -1;
     }
+    outfile << "{\n";
+    outfile << "  \"budgetSeconds\": " << this->timeBudget << ",\n";
+    outfile << "  \"renderSeconds\": " << seconds << ",\n";
+    outfile << "  \"pixels\": " << pixels << ",\n";
+    outfile << "  \"minSamples\": " << (pixels > 0 ? minCount : 0) << ",\n";
+    outfile << "  \"meanSamples\": " << (pixels > 0 ? (double) total / pixels : 0) << ",\n";
+    outfile << "  \"maxSamples\": " << maxCount << "\n";
+    outfile << "}\n";
+    return outfile.good() ? 0 : -1;
+}
 
-    stbi_write_png(filename.c_str(), width, height, 3, &finalImage[0], width * 3);
+int Camera::streamImage(Scene &scene, const string& filename) {
+    // Render the whole frame band by band. Every band is encoded and dropped before the next one
+    // is allocated, so the buffers never hold more than streamRows rows.
+    PngWriter png;
+    png.level = this->compressionLevel;
+    if (png.open(filename, this->width, this->height) != 0) {
+        return -1;
+    }
+    // Rows of the float map are bottom to top and of fixed size, each band is written at its place
+    FILE* hdr = NULL;
+    long hdrHeaderSize = 0;
+    if (this->hdrOutput) {
+        hdr = fopen(replaceExtension(filename, ".pfm").c_str(), "wb");
+        if (hdr == NULL) {
+            return -1;
+        }
+        hdrHeaderSize = fprintf(hdr, "PF\n%d %d\n-1.0\n", this->width, this->height);
+    }
+
+    // A checkpoint of one band cannot be resumed
+    string checkpointFilename = this->checkpointFilename;
+    this->checkpointFilename = "";
+
+    int bandRows = this->streamRows > 0 ? this->streamRows : this->height;
+    vector<unsigned char> row(this->width * 3);
+    vector<float> linear(this->width * 3);
+    int result = 0;
+    for (int band = 0; band < this->height && result == 0; band += bandRows) {
+        int bandEnd = min(band + bandRows, this->height);
+        this->bufferOffset = band * this->width;
+        this->renderedImage.assign((bandEnd - band) * this->width * 3, 0);
+        this->sampleCount.assign((bandEnd - band) * this->width, 0);
+
+        PhaseTimer renderTimer(RenderStats::PHASE_RENDER);
+        // The budget is shared by the bands in proportion to their rows
+        this->renderRows(scene, band, bandEnd, this->timeBudget * (bandEnd - band) / this->height);
+        renderTimer.stop();
+
+        PhaseTimer encodeTimer(RenderStats::PHASE_ENCODE);
+        for (int i = band; i < bandEnd && result == 0; i++) {
+            this->encodeRow(i, &row[0]);
+            result = png.writeRow(&row[0]);
+            if (hdr != NULL && result == 0) {
+                this->linearRow(i, &linear[0]);
+                fseek(hdr, hdrHeaderSize + (long) (this->height - 1 - i) * this->width * 3 * sizeof(float), SEEK_SET);
+                result = fwrite(&linear[0], sizeof(float), linear.size(), hdr) == linear.size() ? 0 : -1;
+            }
+        }
+    }
+    if (result == 0) {
+        result = png.close();
+    }
+    if (hdr != NULL && fclose(hdr) != 0) {
+        result = -1;
+    }
+
+    this->checkpointFilename = checkpointFilename;
+    this->bufferOffset = 0;
+    vector<double>().swap(this->renderedImage);
+    vector<int>().swap(this->sampleCount);
+
+    if (result == 0 && RenderStats::enabled) {
+        RenderStats::collect().writeReport(replaceExtension(filename, ".stats.json"));
+    }
+    return result;
+}
+
+int Camera::denoiseImage() {
+    // Fill denoisedImage from the accumulation and feature buffers of the whole image
+    int pixelCount = this->width * this->height;
+    AovBuffer* albedoAov = findAov(AovBuffer::AOV_ALBEDO);
+    AovBuffer* normalAov = findAov(AovBuffer::AOV_NORMAL);
+    if (this->bufferOffset != 0 || this->aovCount.size() != pixelCount || this->sampleCount.size() != pixelCount
+            || this->luminanceMoments.size() != pixelCount * 2 || albedoAov == NULL || normalAov == NULL) {
+        return -1;
+    }
+    PhaseTimer timer(RenderStats::PHASE_DENOISE);
+    this->denoisedImage.resize(pixelCount * 3);
+    vector<float> albedo(pixelCount * 3);
+    vector<float> normal(pixelCount * 3);
+    vector<float> variance(pixelCount);
+    for (int p = 0; p < pixelCount; p++) {
+        int count = this->sampleCount[p];
+        int features = this->aovCount[p];
+        Vector3f pixelNormal(normalAov->values[p * 3], normalAov->values[p * 3 + 1], normalAov->values[p * 3 + 2]);
+        if (pixelNormal.norm() > 0) {
+            pixelNormal.normalize();
+        }
+        for (int k = 0; k < 3; k++) {
+            this->denoisedImage[p * 3 + k] = count > 0 ? this->renderedImage[p * 3 + k] / count : 0;
+            // Pixels without features are guided by luminance only
+            albedo[p * 3 + k] = features > 0 ? albedoAov->values[p * 3 + k] / features : 1;
+            normal[p * 3 + k] = pixelNormal[k];
+        }
+        // Variance of the mean luminance, unknown below 2 samples
+        variance[p] = -1;
+        if (features > 1) {
+            double mean = this->luminanceMoments[p * 2] / features;
+            double sampleVariance = (this->luminanceMoments[p * 2 + 1] / features - mean * mean) * features / (features - 1);
+            variance[p] = max(sampleVariance, 0.0) / features;
+        }
+    }
+    Denoiser denoiser;
+    denoiser.filter(this->width, this->height, this->denoisedImage, albedo, normal, variance);
+    return 0;
+}
+
+void Camera::linearRow(int row, float* pixels) {
+    // Average of a row held by the buffers, or of the denoised image while it is written
+    if (this->denoisedImage.size() == this->width * this->height * 3) {
+        copy(&this->denoisedImage[row * this->width * 3], &this->denoisedImage[(row + 1) * this->width * 3], pixels);
+        return;
+    }
+    int begin = row * this->width - this->bufferOffset;
+    for (int i = 0; i < this->width * 3; i++) {
+        int count = this->sampleCount[begin + i / 3];
+        pixels[i] = count > 0 ? this->renderedImage[begin * 3 + i] / count : 0;
+    }
+}
+
+class GammaTable {
+    // (unsigned char) (pow(value, 1.0 / 2.2) * 0xFF) for value in [0, 1] without pow :
+    // the byte at the start of each of 4096 buckets, then steps over the values where the byte increases
+    public:
+    static const int buckets = 4096;
+    unsigned char start[buckets + 1];
+    // Smallest value giving byte b, threshold[256] above 1
+    float threshold[257];
+
+    GammaTable() {
+        threshold[0] = 0;
+        for (int b = 1; b < 256; b++) {
+            // Bisection over the bit patterns of the floats in [0, 1], which are ordered like them
+            uint32_t low = 0, high = 0x3F800000;
+            while (low < high) {
+                uint32_t middle = low + (high - low) / 2;
+                float value;
+                memcpy(&value, &middle, sizeof(float));
+                if (exact(value) >= b) high = middle;
+                else low = middle + 1;
+            }
+            memcpy(&threshold[b], &low, sizeof(float));
+        }
+        threshold[256] = 2;
+        for (int k = 0; k <= buckets; k++) {
+            start[k] = exact((float) k / buckets);
+        }
+    }
+
+    static unsigned char exact(float value) {
+        return (unsigned char) (pow(value, 1.0 / 2.2) * 0xFF);
+    }
+
+    unsigned char lookup(float value) const {
+        if (value > 1) return 0xFF;
+        if (!(value >= 0)) return exact(value);
+        int b = start[(int) (value * buckets)];
+        while (value >= threshold[b + 1]) b++;
+        return b;
+    }
+};
+
+static const GammaTable gammaTable;
+
+void Camera::encodeRow(int row, unsigned char* pixels) {
+    // Exposure, tone mapping and gamma of a row held by the buffers, as 8-bit RGB
+    vector<float> linear(this->width * 3);
+    this->linearRow(row, &linear[0]);
+    float scale = pow(2.0f, this->exposure);
+    for (int i = 0; i < this->width * 3; i++) {
+        float value = linear[i] * scale;
+        if (this->toneMapping == TONEMAP_REINHARD) {
+            value = value / (1 + value);
+        }
+        else if (this->toneMapping == TONEMAP_FILMIC) {
+            value = min(max(value * (2.51f * value + 0.03f) / (value * (2.43f * value + 0.59f) + 0.14f), 0.0f), 1.0f);
+        }
+        pixels[i] = gammaTable.lookup(value);
+    }
+}
+
+void Camera::writeImage(const string& filename) {
+    if (this->denoise && this->denoiseImage() != 0) {
+        cerr << "No feature buffers, " << filename << " is not denoised" << endl;
+    }
+    PhaseTimer timer(RenderStats::PHASE_ENCODE);
+    vector<unsigned char> finalImage(this->width * this->height * 3);
+    // Rows are independent, interleaved over the threads
+    int threadCount = max(1, min((int) thread::hardware_concurrency(), this->height));
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.push_back(thread([this, t, threadCount, &finalImage]() {
+            for (int i = t; i < this->height; i += threadCount) {
+                this->encodeRow(i, &finalImage[(size_t) i * this->width * 3]);
+            }
+        }));
+    }
+    for (int t = 0; t < threadCount; t++) {
+        threads[t].join();
+    }
+
+    if (this->baseImage.size() == finalImage.size()) {
+        // Rendered regions over the base image
+        for (int i = 0; i < this->height; i++) {
+            for (int j = 0; j < this->width; j++) {
+                if (!this->inRegions(i, j)) {
+                    int pixel = i * this->width + j;
+                    copy(&this->baseImage[pixel * 3], &this->baseImage[pixel * 3 + 3], &finalImage[pixel * 3]);
+                }
+            }
+        }
+    }
+
+    int x = 0, y = 0, outputWidth = this->width, outputHeight = this->height;
+    if (this->cropOutput && !this->regions.empty()) {
+        // Bounding box of the regions
+        AlignedBox2i box;
+        for (auto it = this->regions.begin(); it != this->regions.end(); it++) {
+            box.extend(Vector2i(it->x, it->y));
+            box.extend(Vector2i(it->x + it->width, it->y + it->height));
+        }
+        x = max(box.min()[0], 0);
+        y = max(box.min()[1], 0);
+        outputWidth = min(box.max()[0], this->width) - x;
+        outputHeight = min(box.max()[1], this->height) - y;
+        if (outputWidth <= 0 || outputHeight <= 0) {
+            cerr << "Regions are outside the image" << endl;
+            return;
+        }
+        vector<unsigned char> cropped;
+        for (int i = y; i < y + outputHeight; i++) {
+            auto row = finalImage.begin() + (i * this->width + x) * 3;
+            cropped.insert(cropped.end(), row, row + outputWidth * 3);
+        }
+        finalImage.swap(cropped);
+    }
+
+    if (PngWriter::write(filename, outputWidth, outputHeight, &finalImage[0], this->compressionLevel) != 0) {
+        cerr << "Cannot write " << filename << endl;
+    }
+
+    if (this->hdrOutput && this->writeHdr(replaceExtension(filename, ".pfm")) != 0) {
+        cerr << "Cannot write " << replaceExtension(filename, ".pfm") << endl;
+    }
+    this->denoisedImage.clear();
+
+    if (this->writeAovs(filename) != 0) {
+        cerr << "Cannot write the AOVs of " << filename << endl;
+    }
+}
+
+int Camera::writeHdr(const string& filename) {
+    // Scale -1 : little-endian floats
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "PF\n%d %d\n-1.0\n", this->width, this->height);
+    vector<float> linear(this->width * 3);
+    bool failed = false;
+    for (int i = this->height - 1; i >= 0 && !failed; i--) {
+        this->linearRow(i, &linear[0]);
+        failed = fwrite(&linear[0], sizeof(float), linear.size(), file) != linear.size();
+    }
+    return fclose(file) != 0 || failed ? -1 : 0;
+}
+
+int Camera::writeAovs(const string& filename) {
+    // Float map of every output buffer as <image>.<name>.pfm, RGB or grayscale
+    if (this->aovCount.size() != this->width * this->height) {
+        return 0;
+    }
+    int result = 0;
+    for (auto it = this->aovs.begin(); it != this->aovs.end(); it++) {
+        if (!it->output) continue;
+        FILE* file = fopen(replaceExtension(filename, "." + it->name + ".pfm").c_str(), "wb");
+        if (file == NULL) {
+            result = -1;
+            continue;
+        }
+        fprintf(file, "%s\n%d %d\n-1.0\n", it->channels == 3 ? "PF" : "Pf", this->width, this->height);
+        vector<float> row(this->width * it->channels);
+        bool failed = false;
+        for (int i = this->height - 1; i >= 0 && !failed; i--) {
+            for (int j = 0; j < this->width; j++) {
+                int pixel = i * this->width + j;
+                int count = this->aovCount[pixel];
+                const double* values = &it->values[pixel * it->channels];
+                if (it->type == AovBuffer::AOV_DEPTH || it->type == AovBuffer::AOV_MATERIAL) {
+                    // Kept as recorded, material -1 where nothing was sampled
+                    row[j] = count > 0 ? values[0] : (it->type == AovBuffer::AOV_DEPTH ? INFINITY : -1);
+                    continue;
+                }
+                Vector3f value(values[0] / max(count, 1), values[1] / max(count, 1), values[2] / max(count, 1));
+                if (it->type == AovBuffer::AOV_NORMAL && value.norm() > 0) {
+                    value.normalize();
+                }
+                for (int k = 0; k < 3; k++) {
+                    row[j * 3 + k] = value[k];
+                }
+            }
+            failed = fwrite(&row[0], sizeof(float), row.size(), file) != row.size();
+        }
+        if (fclose(file) != 0 || failed) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int Camera::loadHdr(const string& filename) {
+    // Colors of a float map as one sample per pixel
+    ifstream file(filename, ios::binary);
+    string magic;
+    int width, height;
+    float scale;
+    if (!(file >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0) {
+        return -1;
+    }
+    file.get();
+
+    vector<float> linear(width * 3);
+    this->width = width;
+    this->height = height;
+    this->bufferOffset = 0;
+    this->renderedImage.assign(width * height * 3, 0);
+    this->sampleCount.assign(width * height, 1);
+    for (int i = height - 1; i >= 0; i--) {
+        if (!file.read((char*) &linear[0], linear.size() * sizeof(float))) {
+            return -1;
+        }
+        for (int k = 0; k < linear.size(); k++) {
+            if (scale > 0) {
+                // Big-endian
+                unsigned char* bytes = (unsigned char*) &linear[k];
+                swap(bytes[0], bytes[3]);
+                swap(bytes[1], bytes[2]);
+            }
+            this->renderedImage[i * width * 3 + k] = linear[k];
+        }
+    }
+    return 0;
+}
+
+void Camera::clearHeatmaps() {
+    this->heatNodes.assign(this->width * this->height, 0);
+    this->heatTriangles.assign(this->width * this->height, 0);
+    this->heatSeconds.assign(this->width * this->height, 0);
+    this->heatSamples.assign(this->width * this->height, 0);
+}
+
+static void writeHeatmap(const string& filename, int width, int height, const vector<double>& values, const vector<int>& samples) {
+    // Average cost per sample, black (none) to blue, red, yellow and white (99th percentile and above)
+    static const float ramp[5][3] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+    vector<double> average(values.size(), 0);
+    for (int i = 0; i < values.size(); i++) {
+        if (samples[i] > 0) {
+            average[i] = values[i] / samples[i];
+        }
+    }
+    vector<double> sorted(average);
+    auto percentile = sorted.begin() + sorted.size() * 99 / 100;
+    nth_element(sorted.begin(), percentile, sorted.end());
+    double maxValue = *percentile;
+
+    vector<unsigned char> heatImage;
+    for (int i = 0; i < average.size(); i++) {
+        float x = maxValue > 0 ? min(average[i] / maxValue, 1.0) * 4 : 0;
+        int stop = min((int) x, 3);
+        float f = x - stop;
+        for (int k = 0; k < 3; k++) {
+            heatImage.push_back((unsigned char) ((ramp[stop][k] * (1 - f) + ramp[stop + 1][k] * f) * 0xFF));
+        }
+    }
+    stbi_write_png(filename.c_str(), width, height, 3, &heatImage[0], width * 3);
+}
+
+void Camera::writeHeatmaps(const string& filename) {
+    writeHeatmap(replaceExtension(filename, ".nodes.png"), this->width, this->height, this->heatNodes, this->heatSamples);
+    writeHeatmap(replaceExtension(filename, ".triangles.png"), this->width, this->height, this->heatTriangles, this->heatSamples);
+    writeHeatmap(replaceExtension(filename, ".time.png"), this->width, this->height, this->heatSeconds, this->heatSamples);
+}
+
+static const char checkpointMagic[4] = {'C', 'G', 'C', 'K'};
+// Bumped whenever the layout after the magic changes
+static const int32_t checkpointVersion = 2;
+
+int Camera::saveCheckpoint(const string& filename) {
+    // Write to a temporary file first, so a crash never leaves a truncated checkpoint
+    string tmpFilename = filename + ".tmp";
+    ofstream outfile(tmpFilename, ios::binary);
+    if (!outfile.is_open()) {
+        return -1;
+    }
+
+    int32_t header[] = {this->width, this->height, this->sampleRate, (int32_t) this->seed, this->firstSample};
+    outfile.write(checkpointMagic, sizeof(checkpointMagic));
+    outfile.write((const char*) &checkpointVersion, sizeof(checkpointVersion));
+    outfile.write((const char*) header, sizeof(header));
+    outfile.write((const char*) &this->sampleCount[0], this->sampleCount.size() * sizeof(int));
+    outfile.write((const char*) &this->renderedImage[0], this->renderedImage.size() * sizeof(double));
+    outfile.close();
+    if (outfile.fail()) {
+        return -1;
+    }
+
+    if (rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int readCheckpoint(const string& filename, int32_t header[5], vector<int>& count, vector<double>& image) {
+    ifstream infile(filename, ios::binary);
+    if (!infile.is_open()) {
+        return -1;
+    }
+
+    char magic[4];
+    int32_t version;
+    infile.read(magic, sizeof(magic));
+    infile.read((char*) &version, sizeof(version));
+    if (!infile || !equal(magic, magic + 4, checkpointMagic)) {
+        return -1;
+    }
+    // Files of older builds have no version, their width is read instead
+    if (version != checkpointVersion) {
+        cerr << filename << " is not in checkpoint format version " << checkpointVersion << " of this build" << endl;
+        return -1;
+    }
+    infile.read((char*) header, 5 * sizeof(int32_t));
+    if (!infile || header[0] <= 0 || header[1] <= 0) {
+        return -1;
+    }
+
+    count.resize(header[0] * header[1]);
+    image.resize(header[0] * header[1] * 3);
+    infile.read((char*) &count[0], count.size() * sizeof(int));
+    infile.read((char*) &image[0], image.size() * sizeof(double));
+    if (!infile) {
+        return -1;
+    }
+    return 0;
+}
+
+int Camera::loadCheckpoint(const string& filename) {
+    // The camera must already be set up as for the interrupted render.
+    // sampleRate may differ, so that a finished render can be refined further.
+    int32_t header[5];
+    vector<int> count;
+    vector<double> image;
+    if (readCheckpoint(filename, header, count, image) != 0) {
+        cerr << "Cannot read " << filename << " as a checkpoint" << endl;
+        return -1;
+    }
+    if (header[0] != this->width || header[1] != this->height || (unsigned int) header[3] != this->seed || header[4] != this->firstSample) {
+        cerr << filename << " is a " << header[0] << "x" << header[1] << " render with seed " << header[3] << " from sample " << header[4]
+            << ", not " << this->width << "x" << this->height << " with seed " << this->seed << " from sample " << this->firstSample << endl;
+        return -1;
+    }
+
+    this->sampleCount = count;
+    this->renderedImage = image;
+    return 0;
+}
+
+int Camera::loadComposite(const string& filename) {
+    // The image or accumulation file to render the regions into : its pixels in the regions are dropped
+    string extension = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+    if (extension == ".png" || extension == ".PNG") {
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(filename.c_str(), &width, &height, &channels, 3);
+        if (pixels == NULL) {
+            return -1;
+        }
+        if (width != this->width || height != this->height) {
+            stbi_image_free(pixels);
+            return -1;
+        }
+        this->baseImage.assign(pixels, pixels + width * height * 3);
+        stbi_image_free(pixels);
+        this->clearImage();
+    }
+    else if (this->loadCheckpoint(filename) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < this->height; i++) {
+        for (int j = 0; j < this->width; j++) {
+            if (this->inRegions(i, j)) {
+                int pixel = i * this->width + j;
+                this->sampleCount[pixel] = 0;
+                this->renderedImage[pixel * 3 + 0] = 0;
+                this->renderedImage[pixel * 3 + 1] = 0;
+                this->renderedImage[pixel * 3 + 2] = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+int Camera::mergeCheckpoint(const string& filename) {
+    // Partial files of disjoint sample ranges or rows are summed with their sample counts
+    int32_t header[5];
+    vector<int> count;
+    vector<double> image;
+    if (readCheckpoint(filename, header, count, image) != 0) {
+        return -1;
+    }
+    if (header[0] != this->width || header[1] != this->height || (unsigned int) header[3] != this->seed) {
+        return -1;
+    }
+
+    if (this->renderedImage.size() != image.size() || this->sampleCount.size() != count.size()) {
+        this->clearImage();
+    }
+    for (int i = 0; i < count.size(); i++) {
+        this->sampleCount[i] += count[i];
+    }
+    for (int i = 0; i < image.size(); i++) {
+        this->renderedImage[i] += image[i];
+    }
+    return 0;
 }
 
 BVH::BVH() {
@@ -1010,6 +2314,8 @@ BVH::BVH() {
     this->childL = NULL;
     this->childR = NULL;
     this->isLeaf = true;
+    this->blocks = NULL;
+    this->blockCount = 0;
 }
 
 BVH::BVH(vector<Vector3f> &v) {
@@ -1017,6 +2323,8 @@ BVH::BVH(vector<Vector3f> &v) {
 }
 
 BVH::BVH(vector<Vector3f> &v, vector<int> &ind) {
+    this->blocks = NULL;
+    this->blockCount = 0;
     this->build(v, ind);
 }
 
@@ -1034,12 +2342,14 @@ void BVH::clear() {
     }
     this->childL = this->childR = NULL;
     this->isLeaf = false;
-    this->verts.clear();
     this->indices.clear();
+    this->blocks = NULL;
+    this->blockCount = 0;
+    this->triangleBlocks.clear();
     this->box = AlignedBox3f();
 }
 
-void BVH::build(vector<Vector3f> &v) {
+void BVH::build(vector<Vector3f> &v, bool packBlocks) {
     this->clear();
 
     vector<int> ind;
@@ -1047,6 +2357,54 @@ void BVH::build(vector<Vector3f> &v) {
         ind.push_back(i);
     }
     this->build(v, ind);
+    if (packBlocks) {
+        this->packTriangles(v);
+    }
+}
+
+static void fillBlock(TriangleBlock& block, const vector<Vector3f> &v, const int* faces, int count) {
+    // Edges computed as BVH::intersectTriangle does, so intersections do not change
+    for (int l = 0; l < 4; l++) {
+        block.face[l] = l < count ? faces[l] : -1;
+        for (int i = 0; i < 3; i++) {
+            if (l < count) {
+                const Vector3f* tri = &v[faces[l] * 3];
+                block.base[i][l] = tri[0][i];
+                block.edge1[i][l] = tri[1][i] - tri[0][i];
+                block.edge2[i][l] = tri[2][i] - tri[0][i];
+            }
+            else {
+                block.base[i][l] = block.edge1[i][l] = block.edge2[i][l] = 0;
+            }
+        }
+    }
+}
+
+static int countBlocks(BVH* node) {
+    if (node->isLeaf) return (node->indices.size() + 3) / 4;
+    return countBlocks(node->childL) + countBlocks(node->childR);
+}
+
+static void packLeaves(BVH* node, const vector<Vector3f> &v, vector<TriangleBlock>& blocks) {
+    // Right child first, the order of traversal
+    if (!node->isLeaf) {
+        packLeaves(node->childR, v, blocks);
+        packLeaves(node->childL, v, blocks);
+        return;
+    }
+    node->blockCount = (node->indices.size() + 3) / 4;
+    node->blocks = blocks.data() + blocks.size();
+    for (int b = 0; b < node->blockCount; b++) {
+        blocks.emplace_back();
+        fillBlock(blocks.back(), v, &node->indices[b * 4], min((int) node->indices.size() - b * 4, 4));
+    }
+}
+
+void BVH::packTriangles(const vector<Vector3f> &v) {
+    // Blocks of the whole tree in one buffer, reserved first so that the leaf pointers stay valid
+    this->triangleBlocks.clear();
+    this->triangleBlocks.reserve(countBlocks(this));
+    packLeaves(this, v, this->triangleBlocks);
 }
 
 void BVH::build(vector<Vector3f> &v, vector<int> &ind) {
@@ -1058,7 +2416,6 @@ void BVH::build(vector<Vector3f> &v, vector<int> &ind) {
 
     if (ind.size() <= leafMax) {
         this->isLeaf = true;
-        this->verts.assign(v.begin(), v.end());
         this->indices.assign(ind.begin(), ind.end());
         this->childL = this->childR = NULL;
         return;
@@ -1101,7 +2458,85 @@ void BVH::build(vector<Vector3f> &v, vector<int> &ind) {
     childR = new BVH(vR, indR);
 }
 
+void BVH::refit(const vector<Vector3f> &v, int parallelDepth) {
+    if (this->isLeaf) {
+        this->box = AlignedBox3f();
+        for (int i = 0; i < this->indices.size(); i++) {
+            for (int j = 0; j < 3; j++) {
+                this->box.extend(v[this->indices[i] * 3 + j]);
+            }
+        }
+        for (int b = 0; b < this->blockCount; b++) {
+            fillBlock(this->blocks[b], v, &this->indices[b * 4], min((int) this->indices.size() - b * 4, 4));
+        }
+        return;
+    }
+
+    if (parallelDepth > 0) {
+        thread left([&]() { this->childL->refit(v, parallelDepth - 1); });
+        this->childR->refit(v, parallelDepth - 1);
+        left.join();
+    }
+    else {
+        this->childL->refit(v, 0);
+        this->childR->refit(v, 0);
+    }
+    this->box = this->childL->box.merged(this->childR->box);
+}
+
+static float surfaceArea(const AlignedBox3f& box) {
+    if (box.isEmpty()) return 0;
+    Vector3f size = box.sizes();
+    return 2 * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+}
+
+static float sahSum(BVH* node) {
+    // Sum of area x cost over the subtree, a node visit and a triangle test both cost 1
+    if (node->isLeaf) {
+        return surfaceArea(node->box) * node->indices.size();
+    }
+    return surfaceArea(node->box) + sahSum(node->childL) + sahSum(node->childR);
+}
+
+float BVH::sahCost() {
+    float area = surfaceArea(this->box);
+    return area > 0 ? sahSum(this) / area : 0;
+}
+
+bool BVH::intersectTriangle(const Vector3f& origin, const Vector3f& direction, const Vector3f* tri, float& t, float& u, float& v) {
+    // Moller-Trumbore, (u, v) are the barycentric coordinates of tri[1] and tri[2]
+    // Written per component, so that the SSE tests of BVH::trace and PacketTracer repeat exactly the same operations
+    const Vector3f& base = tri[0];
+    float v1[3], v2[3], directionV2[3], target[3], targetV1[3];
+    for (int i = 0; i < 3; i++) {
+        v1[i] = tri[1][i] - base[i];
+        v2[i] = tri[2][i] - base[i];
+        target[i] = origin[i] - base[i];
+    }
+    directionV2[0] = direction[1] * v2[2] - direction[2] * v2[1];
+    directionV2[1] = direction[2] * v2[0] - direction[0] * v2[2];
+    directionV2[2] = direction[0] * v2[1] - direction[1] * v2[0];
+    float det = v1[0] * directionV2[0] + v1[1] * directionV2[1] + v1[2] * directionV2[2];
+    
+    if (abs(det) < __FLT_EPSILON__) return false;
+
+    float invDet = 1 / det;
+
+    u = (target[0] * directionV2[0] + target[1] * directionV2[1] + target[2] * directionV2[2]) * invDet;
+    if (u < 0 || u > 1) return false;
+
+    targetV1[0] = target[1] * v1[2] - target[2] * v1[1];
+    targetV1[1] = target[2] * v1[0] - target[0] * v1[2];
+    targetV1[2] = target[0] * v1[1] - target[1] * v1[0];
+    v = (direction[0] * targetV1[0] + direction[1] * targetV1[1] + direction[2] * targetV1[2]) * invDet;
+    if (v < 0 || u + v > 1) return false;
+
+    t = (v2[0] * targetV1[0] + v2[1] * targetV1[1] + v2[2] * targetV1[2]) * invDet;
+    return true;
+}
+
 bool BVH::checkIntersection(const Vector3f& origin, const Vector3f& direction) {
+    STATS_ADD(boxTests, 1);
     float tMin = numeric_limits<float>::min();
     float tMax = numeric_limits<float>::max();
     Vector3f pointMin = this->box.min();
@@ -1128,6 +2563,86 @@ bool BVH::checkIntersection(const Vector3f& origin, const Vector3f& direction) {
     return tMin <= tMax;
 }
 
+static inline void testBlock(const TriangleBlock& block, const __m128* o, const __m128* d, float& nextParam, int& faceIndex, float& minU, float& minV) {
+    // BVH::intersectTriangle for the four triangles of a block, with the same operations in the same order.
+    // The closest hit is then chosen lane by lane, as if the triangles were tested one after another.
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 epsilon = _mm_set1_ps(__FLT_EPSILON__);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+
+    __m128 v1[3], v2[3], target[3];
+    for (int i = 0; i < 3; i++) {
+        v1[i] = _mm_load_ps(block.edge1[i]);
+        v2[i] = _mm_load_ps(block.edge2[i]);
+        target[i] = _mm_sub_ps(o[i], _mm_load_ps(block.base[i]));
+    }
+    __m128 directionV2[3];
+    directionV2[0] = _mm_sub_ps(_mm_mul_ps(d[1], v2[2]), _mm_mul_ps(d[2], v2[1]));
+    directionV2[1] = _mm_sub_ps(_mm_mul_ps(d[2], v2[0]), _mm_mul_ps(d[0], v2[2]));
+    directionV2[2] = _mm_sub_ps(_mm_mul_ps(d[0], v2[1]), _mm_mul_ps(d[1], v2[0]));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v1[0], directionV2[0]), _mm_mul_ps(v1[1], directionV2[1])), _mm_mul_ps(v1[2], directionV2[2]));
+    __m128 valid = _mm_cmpnlt_ps(_mm_andnot_ps(signMask, det), epsilon);
+    if (_mm_movemask_ps(valid) == 0) return;
+
+    __m128 invDet = _mm_div_ps(one, det);
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(target[0], directionV2[0]), _mm_mul_ps(target[1], directionV2[1])), _mm_mul_ps(target[2], directionV2[2])), invDet);
+    valid = _mm_andnot_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)), valid);
+
+    __m128 targetV1[3];
+    targetV1[0] = _mm_sub_ps(_mm_mul_ps(target[1], v1[2]), _mm_mul_ps(target[2], v1[1]));
+    targetV1[1] = _mm_sub_ps(_mm_mul_ps(target[2], v1[0]), _mm_mul_ps(target[0], v1[2]));
+    targetV1[2] = _mm_sub_ps(_mm_mul_ps(target[0], v1[1]), _mm_mul_ps(target[1], v1[0]));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], targetV1[0]), _mm_mul_ps(d[1], targetV1[1])), _mm_mul_ps(d[2], targetV1[2])), invDet);
+    valid = _mm_andnot_ps(_mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)), valid);
+
+    int mask = _mm_movemask_ps(valid);
+    if (mask == 0) return;
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(v2[0], targetV1[0]), _mm_mul_ps(v2[1], targetV1[1])), _mm_mul_ps(v2[2], targetV1[2])), invDet);
+
+    alignas(16) float tLane[4], uLane[4], vLane[4];
+    _mm_store_ps(tLane, t);
+    _mm_store_ps(uLane, u);
+    _mm_store_ps(vLane, v);
+    for (int l = 0; l < 4; l++) {
+        if (!(mask >> l & 1)) continue;
+        if (tLane[l] < nextParam & tLane[l] > 1e-5) {
+            nextParam = tLane[l];
+            minU = uLane[l];
+            minV = vLane[l];
+            faceIndex = block.face[l];
+        }
+    }
+}
+
+void BVH::trace(const Vector3f& origin, const Vector3f& direction, float& nextParam, int& faceIndex, float& minU, float& minV) {
+    // Closest triangle closer than nextParam, depth-first with the right child first
+    // The median split keeps the tree depth logarithmic, so a fixed stack is enough
+    __m128 o[3], d[3];
+    for (int i = 0; i < 3; i++) {
+        o[i] = _mm_set1_ps(origin[i]);
+        d[i] = _mm_set1_ps(direction[i]);
+    }
+
+    BVH* bvhStack[maxDepth];
+    int stackSize = 0;
+    bvhStack[stackSize++] = this;
+    while (stackSize > 0) {
+        BVH* node = bvhStack[--stackSize];
+        if (!node->checkIntersection(origin, direction)) continue;
+        STATS_ADD(nodesVisited, 1);
+        if (!node->isLeaf) {
+            bvhStack[stackSize++] = node->childL;
+            bvhStack[stackSize++] = node->childR;
+            continue;
+        }
+        STATS_ADD(triangleTests, node->indices.size());
+        for (int b = 0; b < node->blockCount; b++) {
+            testBlock(node->blocks[b], o, d, nextParam, faceIndex, minU, minV);
+        }
+    }
+}
+
 UVImage::UVImage() {
     this->width = 1;
     this->height = 1;
@@ -1161,6 +2676,7 @@ bool UVImage::loadImage(const string& filename) {
 
 Vector3f UVImage::getValue(Vector2f uv) {
     // Get nearest value
+    STATS_ADD(textureLookups, 1);
     int x = (((int) (uv[0] * width + 0.5)) % width + width) % width;
     int y = (((int) (uv[1] * height + 0.5)) % height + height) % height;
     return this->data[y * width + x];
@@ -1,5 +1,8 @@
 #pragma once
 #include <vector>
+#include <deque>
+#include <string>
+#include <cstdint>
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Geometry>
 
@@ -23,10 +26,54 @@ class Light {
 
     float spotSize;
     float exponent;
+
+    // Constants derived from the parameters above, updated by precompute
+    float cosSpotSize;
     
     void setPointLight(Vector3f color, Vector3f position);
     void setSunLight(Vector3f color, Vector3f direction);
     void setSpotLight(Vector3f color, Vector3f position, Vector3f direction, float spotSize, float exponent);
+    void precompute();
+};
+
+class LightNode {
+    // Bounds of the lights below a node : positions, total power and the cone of emitted directions
+    // (axis, spread of the light axes, emission angle around them), after Conty and Kulla 2018
+    public:
+    AlignedBox3f box;
+    float power;
+    Vector3f axis;
+    float spreadAngle;
+    float emissionAngle;
+    int childL;
+    int childR;
+    // Leaf : index in Scene::lights, -1 otherwise
+    int light;
+
+    float importance(const Vector3f& point);
+};
+
+class LightTree {
+    // Hierarchy over the point and spot lights, to pick lights in proportion to their estimated contribution
+    public:
+    vector<LightNode> nodes;
+
+    void build(const vector<Light>& lights);
+    int buildNode(const vector<Light>& lights, vector<int>& indices, int begin, int end);
+
+    // Light chosen with random number r, -1 if no light can contribute at point
+    int sample(const Vector3f& point, float r, float& pdf);
+};
+
+class Sampler {
+    // Deterministic random sequence for one (seed, pixel, sample) triple,
+    // so that every sample can be reproduced independently of render order
+    public:
+    uint64_t state;
+
+    Sampler();
+    Sampler(unsigned int seed, int pixel, int sample);
+    float next();
 };
 
 class UVImage {
@@ -84,6 +131,86 @@ class Material {
     static int loadMaterial(const string &filename, vector<Material> &materials);
 };
 
+class PixelRegion {
+    // Pixels [x, x + width) of rows [y, y + height)
+    public:
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+class RayHit {
+    // Closest hit of a ray, as returned by Scene::rayTrace
+    public:
+    bool collided;
+    float dist;
+    int matIndex;
+    Vector3f normal;
+    Vector2f uv;
+};
+
+class PathFeatures {
+    // First hit of a path and the split of its color, for the denoiser and the AOV buffers.
+    // Albedo of the material, normal facing the ray, distance along the ray and material index.
+    // A path missing the scene has the background as albedo, a zero normal, an infinite distance
+    // and material -1.
+    public:
+    Vector3f albedo;
+    Vector3f normal;
+    float depth;
+    int matIndex;
+    // Color up to the light collected at the first hit (the background if missed), the rest is indirect
+    Vector3f direct;
+    // Color brought by each light over the whole path, recorded only if sized to the lights
+    vector<Vector3f> lightColors;
+};
+
+class AovBuffer {
+    // Per-pixel output variable, filled in the same pass as the image (see Camera::aovs).
+    // Depth keeps the nearest first hit of the samples, material the first sample, the others the mean.
+    public:
+    enum AovType {
+        AOV_DEPTH,
+        AOV_NORMAL,
+        AOV_ALBEDO,
+        AOV_MATERIAL,
+        AOV_DIRECT,
+        AOV_INDIRECT,
+        AOV_LIGHT
+    };
+
+    string name;
+    AovType type;
+    // Light of AOV_LIGHT
+    int light;
+    int channels;
+    // Written next to the image, false for buffers only kept for the denoiser
+    bool output;
+    // Sums of the samples for the means, in double as the image
+    vector<double> values;
+
+    // depth, normal, albedo, material, direct, indirect or light<N>
+    static int parse(const string& name, AovBuffer& aov);
+};
+
+class PrimitiveHit {
+    // Nearest primitive found so far by traversal, its attributes are computed once by Scene::hitAttributes
+    public:
+    float dist;
+    // Triangle of the scene (instanceIndex < 0) or of an instance, -1 if none
+    int instanceIndex;
+    int faceIndex;
+    // Barycentric coordinates of the triangle
+    float u;
+    float v;
+    // Sphere closer than the triangle, -1 if none
+    int sphereIndex;
+
+    PrimitiveHit();
+    bool collided();
+};
+
 class Object {
     public:
     vector<Material> materials;
@@ -129,23 +256,77 @@ class SweptSurface : public Object{
     int loadModel(const string& filename, int level, Material material);
 };
 
+class TriangleBlock {
+    // Four triangles in the form used by intersection, one per lane : the first vertex and the edges to the other two.
+    // Unused lanes have zero edges, which the determinant test rejects.
+    public:
+    alignas(16) float base[3][4];
+    alignas(16) float edge1[3][4];
+    alignas(16) float edge2[3][4];
+    int face[4];
+};
+
 class BVH {
     public:
+    // Traversal stack size, the median split keeps the tree depth logarithmic
+    static const int maxDepth = 256;
+
     AlignedBox3f box;
     BVH *childL;
     BVH *childR;
-    vector<Vector3f> verts;
-    vector<int> indices;
     bool isLeaf;
 
+    // Leaf : triangle indices, and their blocks in the buffer of the root
+    vector<int> indices;
+    TriangleBlock* blocks;
+    int blockCount;
+
+    // Root : blocks of all leaves, in traversal order. Shading attributes stay in the scene.
+    vector<TriangleBlock> triangleBlocks;
+
     BVH();
     BVH(vector<Vector3f> &v);
     BVH(vector<Vector3f> &v, vector<int> &ind);
     ~BVH();
+    // Nodes own their children and leaves point into the blocks of the root, so a tree is never copied
+    BVH(const BVH&) = delete;
+    BVH& operator=(const BVH&) = delete;
     void clear();
-    void build(vector<Vector3f> &v);
+    // build(v) builds a root, with the triangle blocks unless the leaves hold something else than
+    // triangles, build(v, ind) the subtree of a node
+    void build(vector<Vector3f> &v, bool packBlocks = true);
     void build(vector<Vector3f> &v, vector<int> &ind);
+    void packTriangles(const vector<Vector3f> &v);
+
+    // Recompute the bounds of the same tree after the vertices moved, v ordered as given to build.
+    // Subtrees above parallelDepth are refitted by separate threads.
+    void refit(const vector<Vector3f> &v, int parallelDepth);
+
+    // Surface area heuristic : expected number of node visits and triangle tests of a ray hitting the root
+    float sahCost();
     bool checkIntersection(const Vector3f& origin, const Vector3f& direction);
+    void trace(const Vector3f& origin, const Vector3f& direction, float& nextParam, int& faceIndex, float& minU, float& minV);
+    static bool intersectTriangle(const Vector3f& origin, const Vector3f& direction, const Vector3f* tri, float& t, float& u, float& v);
+};
+
+class Mesh {
+    // Geometry shared by instances, with its own (bottom-level) BVH in object space
+    public:
+    BVH bvh;
+    float bvhBuildCost;
+    vector<Vector3f> faceVertices;
+    vector<Vector3f> faceNormals;
+    vector<Vector2f> faceUVs;
+    vector<int> faceMaterialIndex;
+};
+
+class MeshInstance {
+    public:
+    int meshIndex;
+    Affine3f transform;
+    Affine3f inverse;
+    // Inverse transpose of the linear part, for normals
+    Matrix3f normalMatrix;
 };
 
 class Scene {
@@ -165,21 +346,79 @@ class Scene {
     vector<Quaternionf> sphereUV;
     vector<int> sphereMaterialIndex;
 
+    // Instanced meshes, found through a top-level BVH over the instance boxes.
+    // A deque, so that meshes (which own their BVH nodes) never move.
+    deque<Mesh> meshes;
+    vector<MeshInstance> instances;
+    BVH instanceBVH;
+
+    // Number of point and spot lights sampled through the light tree at each path vertex.
+    // 0 : every light is evaluated. Sun lights are always evaluated.
+    int lightSamples;
+    LightTree lightTree;
+
+    // Lights whose unoccluded contribution does not exceed this in any channel are skipped
+    // without a shadow ray. 0 : only lights that cannot contribute (outside the spot cone, ...)
+    float minLightContribution;
+
+    // SAH cost of the scene BVH when it was built, updateBVH rebuilds when the refitted cost
+    // exceeds it by bvhRebuildRatio
+    float bvhBuildCost;
+    float bvhRebuildRatio;
+
+    Scene();
+
     void loadObject(Object& object);
+    int loadMesh(Object& object);
+    void loadInstance(int meshIndex, const Affine3f& transform);
     void loadSphere(Vector3f position, float radius, Material material);
     void loadSphere(Vector3f position, float radius, Material material, Quaternionf uvOrientation);
     void loadLight(Light& light);
     void setBackgroundLight(Vector3f light);
     void buildBVH();
-    bool raySurface(Material& mat, Vector3f normal, Vector3f incoming, Vector2f uv, Vector3f& outgoing, Vector3f& weight);
+    void buildLightTree();
+    void updateBVH();
+    bool raySurface(Material& mat, Vector3f normal, Vector3f incoming, Vector2f uv, Vector3f& outgoing, Vector3f& weight, Sampler& sampler);
     bool rayTrace(Vector3f origin, Vector3f direction, float& nextParam, int& nextIndex, Vector3f& nextNormal, Vector2f& nextUV);
     bool rayTrace(Vector3f origin, Vector3f direction, float& nextParam);
+    void traceInstances(const Vector3f& origin, const Vector3f& direction, float& nextParam, int& instanceIndex, int& faceIndex, float& minU, float& minV);
+    void traceSpheres(const Vector3f& origin, const Vector3f& direction, PrimitiveHit& hit);
+    bool tracePrimitive(const Vector3f& origin, const Vector3f& direction, PrimitiveHit& hit);
+    void hitAttributes(const Vector3f& origin, const Vector3f& direction, const PrimitiveHit& hit, int& matIndex, Vector3f& normal, Vector2f& uv);
+    bool completeHit(Vector3f origin, Vector3f direction, int instanceIndex, int faceIndex, float minU, float minV, float& nextParam, int& nextMatIndex, Vector3f& nextNormal, Vector2f& nextUV);
     bool rayTrace(Vector3f origin, Vector3f direction);
-    Vector3f rayCollect(Material& mat, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv);
+    bool lightOccluded(Light& light, Vector3f origin);
+    Vector3f lightShade(Material& mat, Light& light, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv);
+    bool lightNegligible(const Vector3f& intensity);
+    bool sampledLights();
+    Vector3f rayCollect(Material& mat, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv, Sampler& sampler);
+    Vector3f rayCollect(Material& mat, Vector3f origin, Vector3f normal, Vector3f incoming, Vector2f uv, Sampler& sampler, Vector3f weight, Vector3f* lightColors);
+    void hitFeatures(bool collided, float dist, int matIndex, Vector3f normal, Vector3f incoming, Vector2f uv, PathFeatures& features);
 };
 
 class Camera {
     public:
+    // Path : trace each sample depth-first
+    // Wavefront : trace a batch of samples stage by stage (see wavefront.hpp)
+    enum RenderBackend {
+        BACKEND_PATH,
+        BACKEND_WAVEFRONT
+    };
+
+    // Mapping of linear radiance (after exposure) to [0, 1] before gamma.
+    // Clamp : as rendered. Reinhard : x / (1 + x). Filmic : ACES fit of Narkowicz.
+    enum ToneMapping {
+        TONEMAP_CLAMP,
+        TONEMAP_REINHARD,
+        TONEMAP_FILMIC
+    };
+
+    RenderBackend backend;
+    // Sort secondary and shadow rays of the wavefront backend for coherence
+    bool sortRays;
+    // Trace primary rays of the path backend as packets (see packet.hpp)
+    bool packetTracing;
+    int maxCollision;
     int width;
     int height;
     int sampleRate;
@@ -189,8 +428,115 @@ class Camera {
     float fNumber;
     Eigen::Quaternionf orientation;
     Eigen::Vector3f position;
-    vector<float> renderedImage;
+    // Accumulated in double, so merged partial buffers differ from a single render only by the
+    // rounding of the sums in another order : the last bits of the doubles, not the 8-bit PNG in practice
+    vector<double> renderedImage;
+
+    // Per-pixel number of accumulated samples
+    vector<int> sampleCount;
+    // Pixel index of the first pixel held by renderedImage and sampleCount, not 0 while streaming
+    int bufferOffset;
+    unsigned int seed;
+
+    // Part of the frame rendered by this camera, so a frame can be split across processes.
+    // Samples [firstSample, firstSample + sampleRate) of rows [rowBegin, rowEnd), rowEnd < 0 : last row
+    int firstSample;
+    int rowBegin;
+    int rowEnd;
+
+    // Write the averaged linear colors next to the image as <image>.pfm, to tone map again without rendering
+    bool hdrOutput;
+    // Stops applied before tone mapping
+    float exposure;
+    ToneMapping toneMapping;
+    // zlib level of the PNG output, 0 (stored) to 9
+    int compressionLevel;
+
+    // Preview : primary hit and direct light only, one sample per pixel at 1 / previewScale of the
+    // resolution, optionally scaled up to the full resolution when written (0 : full render)
+    int previewScale;
+    bool previewUpscale;
+
+    // Streaming : render bands of streamRows rows and encode each band when it is done, so that the
+    // buffers hold one band instead of the whole image (0 : whole image)
+    int streamRows;
+
+    // Wall-clock seconds for the passes of a render (0 : no limit). Passes stop when the next one is not
+    // expected to fit, with sampleRate still the maximum (sampleRate 0 : no maximum).
+    // The samples reached are written next to the image as <image>.samples.json.
+    float timeBudget;
+
+    // Render only the pixels of these regions (all pixels if empty). Pixels outside them keep their
+    // accumulated samples, or come from baseImage when written. cropOutput writes the bounding box only.
+    vector<PixelRegion> regions;
+    vector<unsigned char> baseImage;
+    bool cropOutput;
+
+    // Arbitrary output variables, written as <image>.<name>.pfm. Every sample records its PathFeatures
+    // into them, aovCount is the number of samples recorded per pixel (empty if nothing is recorded).
+    vector<AovBuffer> aovs;
+    vector<int> aovCount;
+
+    // Denoise the image when written (see denoise.hpp), guided by the albedo and normal buffers.
+    // Samples also add the first two moments of their luminance.
+    bool denoise;
+    vector<double> luminanceMoments;
+    // Denoised average colors, read instead of the accumulation buffers while writing the image
+    vector<float> denoisedImage;
+
+    // Periodic checkpoint of the accumulation state (disabled if empty)
+    string checkpointFilename;
+    float checkpointInterval;
+
+    // Diagnostic mode : trace pixel by pixel and record the cost of every pixel,
+    // written next to the image as heatmaps of BVH nodes visited, triangles tested and time
+    bool heatmaps;
+    vector<double> heatNodes;
+    vector<double> heatTriangles;
+    vector<double> heatSeconds;
+    vector<int> heatSamples;
 
     Camera();
+    void clearImage();
+    void clearAovs();
+    int addAov(const string& name, bool output);
+    // Once the scene is set up : -1 if a light AOV names a light the scene does not have
+    int checkAovs(const Scene& scene);
+    AovBuffer* findAov(AovBuffer::AovType type);
+    PathFeatures* featureRecord(Scene& scene, PathFeatures& features);
+    void addSample(int pixel, const Vector3f& color, const PathFeatures* features);
+    void generateRay(int i, int j, Sampler& sampler, Vector3f& origin, Vector3f& direction);
+    Vector3f samplePixel(Scene &scene, int i, int j, int k, PathFeatures* features);
+    Vector3f tracePath(Scene &scene, Sampler& sampler, Vector3f currentPosition, Vector3f currentDirection, RayHit* primaryHit, PathFeatures* features);
+    void samplePackets(Scene &scene, const vector<int>& pixels, int sample);
+    void samplePixels(Scene &scene, const vector<int>& pixels, int pass);
+    Vector3f previewPixel(Scene &scene, int i, int j);
+    void samplePreview(Scene &scene);
+    void previewImage(Scene &scene, const string& filename);
     void sampleImage(Scene &scene, const string& filename);
+    void continueImage(Scene &scene, const string& filename);
+    void renderRows(Scene &scene, int rowBegin, int rowEnd, double budget);
+    int writeSampleReport(const string& filename, double seconds);
+    void rowSpans(int row, vector<pair<int, int> >& spans);
+    bool inRegions(int i, int j);
+    int loadComposite(const string& filename);
+    int streamImage(Scene &scene, const string& filename);
+    int denoiseImage();
+    void linearRow(int row, float* pixels);
+    void encodeRow(int row, unsigned char* pixels);
+    void writeImage(const string& filename);
+
+    // Portable float map : linear RGB, rows bottom to top
+    int writeHdr(const string& filename);
+    int writeAovs(const string& filename);
+    int loadHdr(const string& filename);
+    void clearHeatmaps();
+    void writeHeatmaps(const string& filename);
+
+    // Checkpoint file : header, per-pixel sample counts and accumulated colors
+    int saveCheckpoint(const string& filename);
+    int loadCheckpoint(const string& filename);
+
+    // Add a partial accumulation file of the same frame to the buffers
+    int mergeCheckpoint(const string& filename);
 };
\ No newline at end of file
@@ -0,0 +1,224 @@
+#include <GL/freeglut.h>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include "viewer.hpp"
+
+// Viewer of the window callbacks
+static Viewer* activeViewer = NULL;
+
+Viewer::Viewer() {
+    this->scene = NULL;
+    this->threadCount = max(1, (int) thread::hardware_concurrency());
+    this->running = false;
+    this->finishedWorkers = 0;
+    this->samplesDone = 0;
+    this->moveStep = 0.25f;
+    this->turnStep = 5.0f;
+}
+
+Viewer::~Viewer() {
+    this->stop();
+}
+
+void Viewer::start(Scene& scene, const Camera& camera) {
+    this->scene = &scene;
+    this->camera = camera;
+    this->camera.heatmaps = false;
+    this->camera.bufferOffset = 0;
+    this->display.assign(camera.width * camera.height * 3, 0);
+    this->restart();
+}
+
+void Viewer::stop() {
+    // Workers finish the row they are rendering
+    this->running = false;
+    for (auto it = this->workers.begin(); it != this->workers.end(); it++) {
+        it->join();
+    }
+    this->workers.clear();
+}
+
+void Viewer::restart() {
+    this->stop();
+    this->camera.clearImage();
+    this->showPreview();
+    this->samplesDone = 0;
+    this->startTime = chrono::steady_clock::now();
+    this->resume();
+}
+
+void Viewer::resume() {
+    // Continue from the samples in the buffers
+    this->running = true;
+    this->finishedWorkers = 0;
+    int threadCount = min(this->threadCount, this->camera.height);
+    for (int t = 0; t < threadCount; t++) {
+        this->workers.push_back(thread(&Viewer::renderRows, this, t));
+    }
+}
+
+void Viewer::showPreview() {
+    // Direct light at 1/8 of the resolution, shown until the rows get their first sample
+    Camera preview = this->camera;
+    preview.width = max(1, this->camera.width / 8);
+    preview.height = max(1, this->camera.height / 8);
+    preview.samplePreview(*this->scene);
+    vector<unsigned char> row(preview.width * 3);
+    lock_guard<mutex> lock(this->displayMutex);
+    for (int i = 0; i < this->camera.height; i++) {
+        preview.encodeRow(min(i * preview.height / this->camera.height, preview.height - 1), &row[0]);
+        for (int j = 0; j < this->camera.width; j++) {
+            int source = min(j * preview.width / this->camera.width, preview.width - 1);
+            for (int k = 0; k < 3; k++) {
+                this->display[(i * this->camera.width + j) * 3 + k] = row[source * 3 + k];
+            }
+        }
+    }
+}
+
+void Viewer::renderRows(int worker) {
+    // Rows worker, worker + workers.size(), ... one sample per row and sweep.
+    // A row is always finished before stopping, so all its pixels have the same count.
+    int width = this->camera.width;
+    int rowCount = this->camera.height;
+    int stride = min(this->threadCount, rowCount);
+    vector<int> pixels(width);
+    vector<unsigned char> row(width * 3);
+    bool busy = true;
+    while (busy) {
+        busy = false;
+        for (int i = worker; i < rowCount; i += stride) {
+            if (!this->running) return;
+            int pass = this->camera.sampleCount[i * width];
+            if (pass >= this->camera.sampleRate) continue;
+            busy = true;
+            for (int j = 0; j < width; j++) {
+                pixels[j] = i * width + j;
+            }
+            this->camera.samplePixels(*this->scene, pixels, pass);
+            this->camera.encodeRow(i, &row[0]);
+            {
+                lock_guard<mutex> lock(this->displayMutex);
+                copy(row.begin(), row.end(), this->display.begin() + i * width * 3);
+            }
+            this->samplesDone += width;
+        }
+    }
+    this->finishedWorkers++;
+}
+
+bool Viewer::converged() {
+    return this->finishedWorkers == (int) this->workers.size();
+}
+
+int Viewer::runHeadless(const string& filename) {
+    // Wait for the workers to finish all samples
+    while (!this->converged()) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    this->stop();
+    this->camera.writeImage(filename);
+    return 0;
+}
+
+void Viewer::handleKey(unsigned char key) {
+    // WASD and QE move along the camera axes, +/- change the field of view, [ ] the focus distance
+    Matrix3f axes = this->camera.orientation.toRotationMatrix();
+    Vector3f move(0, 0, 0);
+    switch (key) {
+        case 'w': move = -axes.col(2); break;
+        case 's': move = axes.col(2); break;
+        case 'a': move = -axes.col(0); break;
+        case 'd': move = axes.col(0); break;
+        case 'q': move = -axes.col(1); break;
+        case 'e': move = axes.col(1); break;
+        case '+': this->camera.fovy = max(this->camera.fovy - 2, 1.0f); break;
+        case '-': this->camera.fovy = min(this->camera.fovy + 2, 170.0f); break;
+        case '[': this->camera.focusDist = max(this->camera.focusDist * 0.9f, 0.01f); break;
+        case ']': this->camera.focusDist *= 1.1f; break;
+        case 'p':
+            // Save what has converged so far and go on
+            this->stop();
+            this->camera.writeImage("data/viewer.png");
+            this->resume();
+            return;
+        case 27:
+            glutLeaveMainLoop();
+            return;
+        default:
+            return;
+    }
+    this->camera.position += move * this->moveStep;
+    this->restart();
+}
+
+void Viewer::handleSpecialKey(int key) {
+    // Arrows turn around the camera's vertical and horizontal axes
+    float angle = this->turnStep * M_PI / 180;
+    Quaternionf turn = Quaternionf::Identity();
+    switch (key) {
+        case GLUT_KEY_LEFT: turn = AngleAxisf(angle, Vector3f::UnitY()); break;
+        case GLUT_KEY_RIGHT: turn = AngleAxisf(-angle, Vector3f::UnitY()); break;
+        case GLUT_KEY_UP: turn = AngleAxisf(angle, Vector3f::UnitX()); break;
+        case GLUT_KEY_DOWN: turn = AngleAxisf(-angle, Vector3f::UnitX()); break;
+        default: return;
+    }
+    this->camera.orientation = (this->camera.orientation * turn).normalized();
+    this->restart();
+}
+
+static void displayWindow() {
+    Viewer* viewer = activeViewer;
+    int windowWidth = glutGet(GLUT_WINDOW_WIDTH);
+    int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
+    glClear(GL_COLOR_BUFFER_BIT);
+    // Top row first, scaled to the window
+    glRasterPos2f(-1, 1);
+    glPixelZoom((float) windowWidth / viewer->camera.width, -(float) windowHeight / viewer->camera.height);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    {
+        lock_guard<mutex> lock(viewer->displayMutex);
+        glDrawPixels(viewer->camera.width, viewer->camera.height, GL_RGB, GL_UNSIGNED_BYTE, &viewer->display[0]);
+    }
+    glutSwapBuffers();
+}
+
+static void refreshWindow(int) {
+    Viewer* viewer = activeViewer;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - viewer->startTime).count();
+    double samples = (double) viewer->samplesDone / ((long long) viewer->camera.width * viewer->camera.height);
+    ostringstream title;
+    title.precision(3);
+    title << samples << " / " << viewer->camera.sampleRate << " spp, " << viewer->samplesDone / max(seconds, 1e-3) / 1e6 << " M samples/s";
+    glutSetWindowTitle(title.str().c_str());
+    glutPostRedisplay();
+    glutTimerFunc(50, refreshWindow, 0);
+}
+
+static void keyWindow(unsigned char key, int, int) {
+    activeViewer->handleKey(key);
+}
+
+static void specialKeyWindow(int key, int, int) {
+    activeViewer->handleSpecialKey(key);
+}
+
+int Viewer::runWindow(int& argc, char** argv) {
+    glutInit(&argc, argv);
+    glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
+    glutInitWindowSize(this->camera.width, this->camera.height);
+    glutCreateWindow("render");
+
+    activeViewer = this;
+    glutDisplayFunc(displayWindow);
+    glutKeyboardFunc(keyWindow);
+    glutSpecialFunc(specialKeyWindow);
+    glutTimerFunc(50, refreshWindow, 0);
+    glutMainLoop();
+
+    activeViewer = NULL;
+    this->stop();
+    return 0;
+}
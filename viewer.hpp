@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "surface.hpp"
+
+// Progressive viewer.
+// Worker threads add one sample at a time to interleaved rows of the camera buffers, and convert
+// every row they finish into the display image. The window only draws the display image, so it
+// never waits for rendering. Moving the camera stops the workers, shows a quick preview
+// (see Camera::samplePreview) and restarts the accumulation.
+//
+// Headless runs use the same workers without a window and write the image once every pixel has
+// camera.sampleRate samples, the same image as a regular render.
+
+class Viewer {
+    public:
+    Scene* scene;
+    Camera camera;
+    int threadCount;
+    vector<thread> workers;
+    atomic<bool> running;
+    atomic<int> finishedWorkers;
+    atomic<long long> samplesDone;
+    chrono::steady_clock::time_point startTime;
+
+    // RGB, rows top to bottom, guarded by displayMutex
+    vector<unsigned char> display;
+    mutex displayMutex;
+
+    // Camera motion per key press
+    float moveStep;
+    float turnStep;
+
+    Viewer();
+    ~Viewer();
+    void start(Scene& scene, const Camera& camera);
+    void stop();
+    void restart();
+    void resume();
+    void showPreview();
+    void renderRows(int worker);
+    bool converged();
+
+    int runHeadless(const string& filename);
+    int runWindow(int& argc, char** argv);
+    void handleKey(unsigned char key);
+    void handleSpecialKey(int key);
+};
@@ -0,0 +1,252 @@
+#include <vector>
+#include <algorithm>
+#include "wavefront.hpp"
+#include "stats.hpp"
+
+WavefrontRenderer::WavefrontRenderer() {
+    this->pathCount = 0;
+    this->sortRays = false;
+    this->closestHitRays = 0;
+    this->shadowRays = 0;
+}
+
+static uint32_t spreadBits(uint32_t x) {
+    // Insert two zero bits between the lower 10 bits, for a 3D Morton code
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+void WavefrontRenderer::sortQueue(vector<int>& queue, bool shadow, Scene& scene) {
+    // Key : direction octant (3 bits) followed by the Morton code of the origin (30 bits)
+    // Queue entries are shadow ray entries, or paths for closest hit rays
+    if (queue.size() < 2) return;
+
+    AlignedBox3f bounds;
+    for (auto it = queue.begin(); it != queue.end(); it++) {
+        bounds.extend(this->pathOrigin[shadow ? this->shadowPath[*it] : *it]);
+    }
+    Vector3f scale = Vector3f::Constant(1023).cwiseQuotient(bounds.sizes().cwiseMax(Vector3f::Constant(1e-6f)));
+
+    this->sortKeys.resize(queue.size());
+    for (int q = 0; q < queue.size(); q++) {
+        int p = shadow ? this->shadowPath[queue[q]] : queue[q];
+        Vector3f direction;
+        if (shadow) {
+            Light& light = scene.lights[this->shadowLight[queue[q]]];
+            if (light.lightType == Light::LIGHT_SUN) {
+                direction = -light.direction;
+            }
+            else {
+                direction = light.position - this->pathOrigin[p];
+            }
+        }
+        else {
+            direction = this->pathDirection[p];
+        }
+        uint32_t octant = (direction[0] < 0) | ((direction[1] < 0) << 1) | ((direction[2] < 0) << 2);
+        Vector3f cell = (this->pathOrigin[p] - bounds.min()).cwiseProduct(scale);
+        uint32_t morton = spreadBits((uint32_t) cell[0]) | (spreadBits((uint32_t) cell[1]) << 1) | (spreadBits((uint32_t) cell[2]) << 2);
+        this->sortKeys[q] = {(octant << 30) | morton, queue[q]};
+    }
+    sort(this->sortKeys.begin(), this->sortKeys.end());
+    for (int q = 0; q < queue.size(); q++) {
+        queue[q] = this->sortKeys[q].second;
+    }
+}
+
+void WavefrontRenderer::render(Scene& scene, Camera& camera, const vector<int>& pixels, int sample) {
+    for (int begin = 0; begin < pixels.size(); begin += batchSize) {
+        int end = min(begin + batchSize, (int) pixels.size());
+        generateStage(scene, camera, pixels, begin, end, sample);
+
+        for (int collision = 1; collision <= camera.maxCollision && this->pathCount > 0; collision++) {
+            // Primary rays are coherent already
+            if (collision == 1) {
+                STATS_ADD(primaryRays, this->pathCount);
+            }
+            else {
+                STATS_ADD(secondaryRays, this->pathCount);
+            }
+            closestHitStage(scene, this->sortRays && collision > 1);
+            shadowStage(scene);
+            shadingStage();
+            if (collision == 1 && !this->pathFeatures.empty()) {
+                featureStage(scene);
+            }
+            materialStage(scene);
+            compact(camera, collision);
+        }
+
+        // Paths reaching the collision limit
+        fill(this->pathActive.begin(), this->pathActive.begin() + this->pathCount, false);
+        compact(camera, camera.maxCollision);
+    }
+}
+
+void WavefrontRenderer::generateStage(Scene& scene, Camera& camera, const vector<int>& pixels, int begin, int end, int sample) {
+    this->pathCount = end - begin;
+    this->pathPixel.resize(this->pathCount);
+    this->pathSampler.resize(this->pathCount);
+    this->pathOrigin.resize(this->pathCount);
+    this->pathDirection.resize(this->pathCount);
+    this->pathWeight.resize(this->pathCount);
+    this->pathColor.resize(this->pathCount);
+    this->pathActive.resize(this->pathCount);
+    PathFeatures features;
+    this->pathFeatures.assign(camera.featureRecord(scene, features) != NULL ? this->pathCount : 0, features);
+    this->hitDist.resize(this->pathCount);
+    this->hitMatIndex.resize(this->pathCount);
+    this->hitNormal.resize(this->pathCount);
+    this->hitUV.resize(this->pathCount);
+
+    for (int p = 0; p < this->pathCount; p++) {
+        int pixel = pixels[begin + p];
+        this->pathPixel[p] = pixel;
+        this->pathSampler[p] = Sampler(camera.seed, pixel, sample);
+        camera.generateRay(pixel / camera.width, pixel % camera.width, this->pathSampler[p], this->pathOrigin[p], this->pathDirection[p]);
+        this->pathWeight[p] = Vector3f(1, 1, 1);
+        this->pathColor[p] = Vector3f(0, 0, 0);
+        this->pathActive[p] = true;
+    }
+}
+
+void WavefrontRenderer::closestHitStage(Scene& scene, bool sort) {
+    this->hitQueue.resize(this->pathCount);
+    for (int p = 0; p < this->pathCount; p++) {
+        this->hitQueue[p] = p;
+    }
+    if (sort) {
+        sortQueue(this->hitQueue, false, scene);
+    }
+    this->closestHitRays += this->hitQueue.size();
+
+    for (auto it = this->hitQueue.begin(); it != this->hitQueue.end(); it++) {
+        int p = *it;
+        bool collided = scene.rayTrace(this->pathOrigin[p], this->pathDirection[p], this->hitDist[p], this->hitMatIndex[p], this->hitNormal[p], this->hitUV[p]);
+        if (!collided) {
+            this->pathColor[p] += scene.backgroundLight.cwiseProduct(this->pathWeight[p]);
+            this->pathActive[p] = false;
+            continue;
+        }
+        this->pathOrigin[p] += this->pathDirection[p] * this->hitDist[p];
+    }
+}
+
+void WavefrontRenderer::featureStage(Scene& scene) {
+    // Only the paths that missed are inactive after the first hit, and their color is the background
+    for (int p = 0; p < this->pathCount; p++) {
+        scene.hitFeatures(this->pathActive[p], this->hitDist[p], this->hitMatIndex[p], this->hitNormal[p], this->pathDirection[p], this->hitUV[p], this->pathFeatures[p]);
+        this->pathFeatures[p].direct = this->pathColor[p];
+    }
+}
+
+void WavefrontRenderer::shadowStage(Scene& scene) {
+    // Lights of every path as chosen by Scene::rayCollect, drawing the same random numbers
+    int numLights = scene.lights.size();
+    bool sampled = scene.sampledLights();
+    this->shadowBegin.resize(this->pathCount + 1);
+    this->shadowPath.clear();
+    this->shadowLight.clear();
+    this->shadowIntensity.clear();
+    for (int p = 0; p < this->pathCount; p++) {
+        this->shadowBegin[p] = this->shadowPath.size();
+        if (!this->pathActive[p]) continue;
+        Material& mat = scene.materials[this->hitMatIndex[p]];
+        for (int l = 0; l < numLights; l++) {
+            if (sampled && scene.lights[l].lightType != Light::LIGHT_SUN) continue;
+            Vector3f intensity = scene.lightShade(mat, scene.lights[l], this->pathOrigin[p], this->hitNormal[p], this->pathDirection[p], this->hitUV[p]);
+            if (scene.lightNegligible(intensity)) continue;
+            this->shadowPath.push_back(p);
+            this->shadowLight.push_back(l);
+            this->shadowIntensity.push_back(intensity);
+        }
+        for (int k = 0; sampled && k < scene.lightSamples; k++) {
+            float pdf;
+            int l = scene.lightTree.sample(this->pathOrigin[p], this->pathSampler[p].next(), pdf);
+            if (l < 0) continue;
+            Vector3f intensity = scene.lightShade(mat, scene.lights[l], this->pathOrigin[p], this->hitNormal[p], this->pathDirection[p], this->hitUV[p]) / (pdf * scene.lightSamples);
+            if (scene.lightNegligible(intensity)) continue;
+            this->shadowPath.push_back(p);
+            this->shadowLight.push_back(l);
+            this->shadowIntensity.push_back(intensity);
+        }
+    }
+    this->shadowBegin[this->pathCount] = this->shadowPath.size();
+
+    this->shadowQueue.resize(this->shadowPath.size());
+    for (int e = 0; e < this->shadowQueue.size(); e++) {
+        this->shadowQueue[e] = e;
+    }
+    if (this->sortRays) {
+        sortQueue(this->shadowQueue, true, scene);
+    }
+    this->shadowRays += this->shadowQueue.size();
+
+    this->shadowOccluded.resize(this->shadowQueue.size());
+    for (auto it = this->shadowQueue.begin(); it != this->shadowQueue.end(); it++) {
+        this->shadowOccluded[*it] = scene.lightOccluded(scene.lights[this->shadowLight[*it]], this->pathOrigin[this->shadowPath[*it]]);
+    }
+}
+
+void WavefrontRenderer::shadingStage() {
+    // Same sum as Scene::rayCollect, with the shadow rays already traced
+    for (int p = 0; p < this->pathCount; p++) {
+        if (!this->pathActive[p]) continue;
+        Vector3f totalIntensity;
+        totalIntensity << 0, 0, 0;
+        Vector3f* lightColors = this->pathFeatures.empty() || this->pathFeatures[p].lightColors.empty() ? NULL : &this->pathFeatures[p].lightColors[0];
+        for (int e = this->shadowBegin[p]; e < this->shadowBegin[p + 1]; e++) {
+            if (this->shadowOccluded[e]) continue;
+            totalIntensity += this->shadowIntensity[e];
+            if (lightColors != NULL) {
+                lightColors[this->shadowLight[e]] += this->shadowIntensity[e].cwiseProduct(this->pathWeight[p]);
+            }
+        }
+        this->pathColor[p] += totalIntensity.cwiseProduct(this->pathWeight[p]);
+    }
+}
+
+void WavefrontRenderer::materialStage(Scene& scene) {
+    for (int p = 0; p < this->pathCount; p++) {
+        if (!this->pathActive[p]) continue;
+        Material& mat = scene.materials[this->hitMatIndex[p]];
+        Vector3f nextDirection;
+        Vector3f weightMult;
+        if (!scene.raySurface(mat, this->hitNormal[p], this->pathDirection[p], this->hitUV[p], nextDirection, weightMult, this->pathSampler[p])) {
+            this->pathActive[p] = false;
+            continue;
+        }
+        this->pathWeight[p] = this->pathWeight[p].cwiseProduct(weightMult);
+        this->pathDirection[p] = nextDirection;
+    }
+}
+
+void WavefrontRenderer::compact(Camera& camera, int pathLength) {
+    // Accumulate finished paths and move the live ones to the front
+    int alive = 0;
+    for (int p = 0; p < this->pathCount; p++) {
+        if (!this->pathActive[p]) {
+            STATS_PATH(pathLength);
+            camera.addSample(this->pathPixel[p], this->pathColor[p], this->pathFeatures.empty() ? NULL : &this->pathFeatures[p]);
+            continue;
+        }
+        if (alive != p) {
+            this->pathPixel[alive] = this->pathPixel[p];
+            this->pathSampler[alive] = this->pathSampler[p];
+            this->pathOrigin[alive] = this->pathOrigin[p];
+            this->pathDirection[alive] = this->pathDirection[p];
+            this->pathWeight[alive] = this->pathWeight[p];
+            this->pathColor[alive] = this->pathColor[p];
+            this->pathActive[alive] = true;
+            if (!this->pathFeatures.empty()) {
+                swap(this->pathFeatures[alive], this->pathFeatures[p]);
+            }
+        }
+        alive++;
+    }
+    this->pathCount = alive;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+#include "surface.hpp"
+
+// Wavefront path tracing.
+// Instead of following one sample to the end, a batch of paths advances stage by stage
+// (camera rays, closest hit, shadow rays, shading, material sampling), each stage being
+// a tight loop over a queue. Finished paths are compacted away after every bounce.
+// Paths use the same samplers as Camera::samplePixel, so the image is identical.
+
+class WavefrontRenderer {
+    public:
+    static const int batchSize = 1 << 16;
+
+    // Path state (structure of arrays), paths [0, pathCount) are alive
+    int pathCount;
+    vector<int> pathPixel;
+    vector<Sampler> pathSampler;
+    vector<Vector3f> pathOrigin;
+    vector<Vector3f> pathDirection;
+    vector<Vector3f> pathWeight;
+    vector<Vector3f> pathColor;
+    vector<bool> pathActive;
+    // First hit and color split of every path, recorded while the camera has AOV buffers
+    vector<PathFeatures> pathFeatures;
+
+    // Closest hit of the current bounce
+    vector<float> hitDist;
+    vector<int> hitMatIndex;
+    vector<Vector3f> hitNormal;
+    vector<Vector2f> hitUV;
+
+    // Closest hit rays, as path indices
+    vector<int> hitQueue;
+
+    // Shadow rays of the bounce, grouped by path : entries [shadowBegin[p], shadowBegin[p + 1]) of path p,
+    // each with its light and its unoccluded contribution. Lights that do not contribute get no entry.
+    vector<int> shadowBegin;
+    vector<int> shadowPath;
+    vector<int> shadowLight;
+    vector<Vector3f> shadowIntensity;
+    vector<bool> shadowOccluded;
+
+    // Shadow rays in tracing order, as entries
+    vector<int> shadowQueue;
+
+    // Group secondary and shadow rays by direction octant and origin cell before tracing,
+    // so that consecutive rays visit the same BVH nodes and triangles
+    bool sortRays;
+    vector<pair<uint32_t, int> > sortKeys;
+
+    // Traced rays
+    long long closestHitRays;
+    long long shadowRays;
+
+    WavefrontRenderer();
+
+    void render(Scene& scene, Camera& camera, const vector<int>& pixels, int sample);
+
+    void generateStage(Scene& scene, Camera& camera, const vector<int>& pixels, int begin, int end, int sample);
+    void sortQueue(vector<int>& queue, bool shadow, Scene& scene);
+    void closestHitStage(Scene& scene, bool sort);
+    // After shading the first hit
+    void featureStage(Scene& scene);
+    void shadowStage(Scene& scene);
+    void shadingStage();
+    void materialStage(Scene& scene);
+    // Finished paths have traced pathLength closest hit rays
+    void compact(Camera& camera, int pathLength);
+};